@@ -8,6 +8,113 @@
 #define DMA_TRANSFERB_V  2
 #define DMA_TRANSFERB_R  3
 
+/* OR'ed into a transfer type: run while the CPU continues, and on completion
+   raise an IRQ and charge the CPU for the bus cycles taken. The DMA status
+   register reads 1 until the transfer completes. The IRQ is held while IRQs
+   are masked, until the handler is entered or the status register is read. */
+#define DMA_CONTEND      0x20
+#define DMA_IRQ          0x40
+#define DMA_ASYNC        0x80
+
+#define DMA_BLIT_SRC_REAL  0x01
+#define DMA_BLIT_DEST_REAL 0x02
+#define DMA_BLIT_KEYED     0x04
+
+struct dma_blit {
+    unsigned long src;
+    unsigned long dest;
+    unsigned short width;           /* Pixels per line */
+    unsigned short height;          /* Lines */
+    unsigned short src_pitch;       /* Bytes between source lines */
+    unsigned short dest_pitch;      /* Bytes between destination lines */
+    unsigned char pixel_size;       /* Bytes per pixel, 1 to 4 */
+    unsigned char flags;            /* DMA_BLIT_* */
+    unsigned long key;              /* Transparent pixel value if DMA_BLIT_KEYED */
+};
+
+#define DMA_FILL_DEST_REAL 0x01
+
+struct dma_fill {
+    unsigned long dest;
+    unsigned long count;            /* Patterns per line */
+    unsigned short lines;           /* 1 for a linear fill */
+    unsigned short pitch;           /* Bytes between lines */
+    unsigned char pattern_size;     /* 1, 2 or 4 bytes */
+    unsigned char flags;            /* DMA_FILL_* */
+    unsigned long pattern;
+};
+
+#define PIXEL_BGR888 0
+#define PIXEL_RGB888 1
+#define PIXEL_RGB565 2
+#define PIXEL_PAL8   3                  /* Source only */
+
+#define DMA_CONVERT_SRC_REAL  0x01      /* Also applies to the palette */
+#define DMA_CONVERT_DEST_REAL 0x02
+
+struct dma_convert {
+    unsigned long src;
+    unsigned long dest;
+    unsigned short width;           /* Pixels per line */
+    unsigned short height;          /* Lines */
+    unsigned short src_pitch;       /* Bytes between source lines */
+    unsigned short dest_pitch;      /* Bytes between destination lines */
+    unsigned char src_format;       /* PIXEL_* */
+    unsigned char dest_format;      /* PIXEL_*, not PIXEL_PAL8 */
+    unsigned short flags;           /* DMA_CONVERT_* */
+    unsigned long palette;          /* 256 BGR888 entries if PIXEL_PAL8 */
+};
+
+/* Tile and sprite device registers, as offsets into the DEVICES area a memory
+   map names device PPU. Tables are in real memory at the addresses given; the
+   device draws into the framebuffer when each frame is published. */
+#define PPU_CONTROL       0x00          /* PPU_ENABLE etc. */
+#define PPU_SPRITE_COUNT  0x01
+#define PPU_BACKDROP      0x02          /* RGB565 */
+#define PPU_TARGET        0x04          /* Output, $A0000 by default */
+#define PPU_TARGET_PITCH  0x08
+#define PPU_WIDTH         0x0a
+#define PPU_HEIGHT        0x0c
+#define PPU_FRAME         0x0e          /* Frames drawn, read-only */
+#define PPU_PALETTE       0x10          /* 256 RGB565 entries */
+#define PPU_SPRITES       0x14          /* struct ppu_sprite[] */
+#define PPU_SPRITE_TILES  0x18
+#define PPU_LAYER(n)      (0x20 + (n) * 0x10)
+#define PPU_LAYER_MAP        0x00       /* Entries of PPU_MAP_* bits */
+#define PPU_LAYER_TILES      0x04       /* 8x8 tiles of 8-bit indices, 0 clear */
+#define PPU_LAYER_SCROLL_X   0x08
+#define PPU_LAYER_SCROLL_Y   0x0a
+#define PPU_LAYER_MAP_WIDTH  0x0c       /* Log2 of the map size in tiles */
+#define PPU_LAYER_MAP_HEIGHT 0x0d
+
+#define PPU_ENABLE        0x01
+#define PPU_LAYER0        0x02
+#define PPU_LAYER1        0x04
+#define PPU_SPRITES_ON    0x08
+
+#define PPU_MAP_TILE      0x0fff
+#define PPU_MAP_FLIP_X    0x1000
+#define PPU_MAP_FLIP_Y    0x2000
+#define PPU_MAP_HIGH      0x4000        /* In front of sprites without priority */
+
+#define PPU_SPRITE_FLIP_X 0x01
+#define PPU_SPRITE_FLIP_Y 0x02
+#define PPU_SPRITE_HIGH   0x04          /* In front of both layers */
+#define PPU_SPRITE_HIDDEN 0x80
+
+struct ppu_sprite {
+    short x;
+    short y;
+    unsigned short tile;            /* First of width * height tiles */
+    unsigned char flags;            /* PPU_SPRITE_* */
+    unsigned char size;             /* Width - 1 | (height - 1) << 3, in tiles */
+};
+
 extern void mmu_map_bank(unsigned short real, unsigned char virt);
 //extern void dma_transferb(unsigned char *src, unsigned char *dest, unsigned long size, unsigned char type);
+extern void __fastcall__ dma_blit(const struct dma_blit *blit);
+extern void __fastcall__ dma_fill(const struct dma_fill *fill);
+extern void __fastcall__ dma_convert(const struct dma_convert *convert);
+/* Hand the finished frame to the display, which shows frames whole */
+extern void frame_present(void);
 extern void dma_transferb(unsigned short src_h, unsigned short src_l, unsigned short dest_h, unsigned short dest_l, unsigned long size, unsigned char type);
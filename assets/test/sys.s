@@ -6,10 +6,14 @@
 
 	.setcpu	"65816"
     .smart on
-    .importzp sp
+    .importzp sp, ptr1
     .import popa
     .export _mmu_map_bank
     .export _dma_transferb
+    .export _dma_blit
+    .export _dma_fill
+    .export _dma_convert
+    .export _frame_present
     .export _DISPLAY
     .export _IMAGE
 
@@ -51,7 +55,7 @@ _IMAGE = $10000
 
     sep #$20
     sta @Type
-    rep #$20
+    rep #$21 ; Also clears carry for the pop below
     ldy #0
     lda (sp),y
     sta @Size
@@ -86,10 +90,105 @@ _IMAGE = $10000
 @Size: .dword $a5a5a5a5 ; Placeholder
 
     lda sp
-    sbc #12
+    adc #12 ; Pop the arguments
     sta sp
     sep #$20
 
     rts
 
 .endproc
+
+; ----------------------------------------------------------------------
+; void __fastcall__ dma_blit (const struct dma_blit *blit)
+; ----------------------------------------------------------------------
+
+.proc _dma_blit
+
+    sta ptr1
+    stx ptr1 + 1
+    sep #$20
+    ldy #0
+
+@Copy:
+    lda (ptr1),y
+    sta @Args,y
+    iny
+    cpy #22
+    bne @Copy
+
+    cop #11
+
+@Type: .byte 5
+@Args: .res 22
+
+    rts
+
+.endproc
+
+; ----------------------------------------------------------------------
+; void __fastcall__ dma_fill (const struct dma_fill *fill)
+; ----------------------------------------------------------------------
+
+.proc _dma_fill
+
+    sta ptr1
+    stx ptr1 + 1
+    sep #$20
+    ldy #0
+
+@Copy:
+    lda (ptr1),y
+    sta @Args,y
+    iny
+    cpy #18
+    bne @Copy
+
+    cop #9
+
+@Type: .byte 6
+@Args: .res 18
+
+    rts
+
+.endproc
+
+; ----------------------------------------------------------------------
+; void __fastcall__ dma_convert (const struct dma_convert *convert)
+; ----------------------------------------------------------------------
+
+.proc _dma_convert
+
+    sta ptr1
+    stx ptr1 + 1
+    sep #$20
+    ldy #0
+
+@Copy:
+    lda (ptr1),y
+    sta @Args,y
+    iny
+    cpy #24
+    bne @Copy
+
+    cop #12
+
+@Type: .byte 7
+@Args: .res 24
+
+    rts
+
+.endproc
+
+; ----------------------------------------------------------------------
+; void frame_present (void)
+; ----------------------------------------------------------------------
+
+.proc _frame_present
+
+    cop #0
+
+@Type: .byte 8
+
+    rts
+
+.endproc
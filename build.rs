@@ -5,6 +5,10 @@ fn main() {
         .file("src/processor/sys/wdc816.cc")
         .file("src/processor/sys/mem816.cc")
         .file("src/processor/sys/emu816.cc")
+        .file("src/processor/sys/dma.cpp")
+        .file("src/processor/sys/ppu.cpp")
+        .file("src/processor/sys/perf.cpp")
+        .file("src/processor/sys/metrics.cpp")
         .file("src/processor/sys/ffi.cpp")
         .cpp(true)
         .flag_if_supported("-std=c++20")
@@ -0,0 +1,214 @@
+//! Recording of the guest's frames to a file for regression evidence.
+//!
+//! The CPU thread copies each captured frame into one of a few buffers and
+//! hands it to an encoder thread, which writes it and hands the buffer back.
+//! When the encoder falls behind and no buffer is free, frames are dropped
+//! rather than the guest held up.
+//!
+//! A raw capture is the frames' RGB565 pixels back to back, as read by
+//! `ffmpeg -f rawvideo -pixel_format rgb565le -video_size 1024x720`. A delta
+//! capture starts with the header
+//!
+//! ```text
+//! magic "YCAP", version, width, height          u32 each, little endian
+//! ```
+//!
+//! followed by a record per frame:
+//!
+//! ```text
+//! guest cycles u64, frame number u32, packet bytes u32, packets
+//! ```
+//!
+//! The frame number counts the frames offered for capture, so drops show as
+//! gaps. The packets encode the XOR of the frame with the one before, which
+//! starts black, as 16-bit pixels: a u16 control word of `n - 1` is followed
+//! by `n` literal pixels, and one of `0x8000 | n - 1` by a pixel repeated `n`
+//! times.
+
+use std::fs::File;
+use std::io::{self, BufWriter, Write};
+use std::sync::mpsc::{self, Receiver, SyncSender};
+use std::sync::Mutex;
+use std::thread::{self, JoinHandle};
+
+use crate::{headless, memory, processor, FRAMEBUFFER, FRAME_HEIGHT, FRAME_SIZE, FRAME_WIDTH};
+
+#[cfg(test)]
+mod tests;
+
+/// Frames that may wait for the encoder.
+const BUFFERS: usize = 4;
+
+const MAGIC: u32 = u32::from_le_bytes(*b"YCAP");
+const VERSION: u32 = 1;
+
+/// Longest run or literal packet.
+const PACKET_MAX: usize = 0x8000;
+
+#[derive(Clone, Copy, PartialEq, Eq)]
+pub enum Format {
+    /// Uncompressed RGB565 frames.
+    Raw,
+    /// Each frame as runs of its difference from the last.
+    Delta
+}
+
+struct Frame {
+    pixels: Vec<u8>,
+    cycles: u64,
+    number: u32
+}
+
+struct Capture {
+    frames: SyncSender<Frame>,
+    free: Receiver<Vec<u8>>,
+    encoder: JoinHandle<io::Result<()>>,
+    /// Guest cycles between captured frames.
+    interval: u64,
+    next: u64,
+    offered: u32,
+    captured: u32,
+    dropped: u32
+}
+
+static CAPTURE: Mutex<Option<Capture>> = Mutex::new(None);
+
+/// Starts capturing up to `rate` frames a second of guest time to `path`.
+pub fn start(path: &str, format: Format, rate: u32) -> Result<(), String> {
+    if rate == 0 {
+        return Err(String::from("rate must not be zero"))
+    }
+
+    let file = BufWriter::new(File::create(path).map_err(|error| error.to_string())?);
+    let (frames, queued) = mpsc::sync_channel::<Frame>(BUFFERS);
+    let (returned, free) = mpsc::channel();
+
+    for _ in 0..BUFFERS {
+        returned.send(vec![0u8; FRAME_SIZE]).unwrap();
+    }
+
+    let encoder = thread::spawn(move || encode(file, format, queued, returned));
+
+    *CAPTURE.lock().unwrap() = Some(Capture {
+        frames,
+        free,
+        encoder,
+        interval: (headless::DEFAULT_FRAME_CYCLES * 60 / rate as u64).max(1),
+        next: 0,
+        offered: 0,
+        captured: 0,
+        dropped: 0
+    });
+    Ok(())
+}
+
+/// Offers the framebuffer as a finished frame. Called on the CPU thread at
+/// each frame published to the presenter; copies it only if it is due and a
+/// buffer is free.
+pub fn frame() {
+    let mut capture = CAPTURE.lock().unwrap();
+    let Some(capture) = capture.as_mut() else { return };
+    let cycles = processor::get_cycles();
+
+    if cycles < capture.next {
+        return
+    }
+
+    let number = capture.offered;
+    capture.offered += 1;
+    capture.next = (capture.next + capture.interval).max(cycles);
+
+    let Ok(mut pixels) = capture.free.try_recv() else {
+        capture.dropped += 1;
+        return
+    };
+
+    memory::read_real(FRAMEBUFFER, &mut pixels);
+    if capture.frames.send(Frame { pixels, cycles, number }).is_ok() {
+        capture.captured += 1;
+    }
+}
+
+/// Stops capturing and waits for the frames queued to be written.
+pub fn finish() {
+    let Some(capture) = CAPTURE.lock().unwrap().take() else { return };
+
+    drop(capture.frames);
+    match capture.encoder.join().unwrap() {
+        Ok(()) => println!("CAPTURE: FRAMES {{{}}} DROPPED {{{}}}", capture.captured, capture.dropped),
+        Err(error) => println!("CAPTURE: CANNOT WRITE: {}", error)
+    }
+}
+
+/// Writes the frames queued until the CPU thread stops capturing.
+fn encode(mut file: BufWriter<File>, format: Format, queued: Receiver<Frame>, returned: mpsc::Sender<Vec<u8>>) -> io::Result<()> {
+    let mut last = vec![0u8; FRAME_SIZE];
+    let mut packets = Vec::with_capacity(FRAME_SIZE);
+
+    if format == Format::Delta {
+        for word in [MAGIC, VERSION, FRAME_WIDTH as u32, FRAME_HEIGHT as u32] {
+            file.write_all(&word.to_le_bytes())?;
+        }
+    }
+
+    for frame in queued {
+        match format {
+            Format::Raw => file.write_all(&frame.pixels)?,
+            Format::Delta => {
+                packets.clear();
+                pack(&frame.pixels, &last, &mut packets);
+
+                file.write_all(&frame.cycles.to_le_bytes())?;
+                file.write_all(&frame.number.to_le_bytes())?;
+                file.write_all(&(packets.len() as u32).to_le_bytes())?;
+                file.write_all(&packets)?;
+
+                last.copy_from_slice(&frame.pixels);
+            }
+        }
+
+        // The CPU thread may have stopped capturing already
+        let _ = returned.send(frame.pixels);
+    }
+
+    file.flush()
+}
+
+/// Appends the packets of the difference between two frames.
+fn pack(pixels: &[u8], last: &[u8], packets: &mut Vec<u8>) {
+    let delta = |i: usize| u16::from_le_bytes([pixels[2 * i] ^ last[2 * i], pixels[2 * i + 1] ^ last[2 * i + 1]]);
+    let count = pixels.len() / 2;
+    let mut i = 0;
+
+    while i < count {
+        let value = delta(i);
+        let mut run = 1;
+
+        while run < PACKET_MAX && i + run < count && delta(i + run) == value {
+            run += 1;
+        }
+
+        if run > 2 {
+            packets.extend_from_slice(&(0x8000 | (run - 1) as u16).to_le_bytes());
+            packets.extend_from_slice(&value.to_le_bytes());
+            i += run;
+            continue
+        }
+
+        // Literals run until a run of three is worth its own packet
+        let start = i;
+        while i < count && i - start < PACKET_MAX {
+            let value = delta(i);
+
+            if i + 2 < count && delta(i + 1) == value && delta(i + 2) == value {
+                break
+            }
+            i += 1;
+        }
+
+        packets.extend_from_slice(&((i - start - 1) as u16).to_le_bytes());
+        for j in start..i {
+            packets.extend_from_slice(&delta(j).to_le_bytes());
+        }
+    }
+}
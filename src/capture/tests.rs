@@ -0,0 +1,110 @@
+use super::{pack, PACKET_MAX};
+
+/// Decodes `packets` against the frame before, `last`, as a reader of a
+/// delta capture would.
+fn unpack(packets: &[u8], last: &[u8]) -> Vec<u8> {
+    let word = |at: usize| u16::from_le_bytes([packets[at], packets[at + 1]]);
+    let mut deltas = Vec::new();
+    let mut at = 0;
+
+    while at < packets.len() {
+        let control = word(at);
+        let count = (control & 0x7FFF) as usize + 1;
+
+        if control & 0x8000 != 0 {
+            deltas.extend(std::iter::repeat(word(at + 2)).take(count));
+            at += 4;
+        } else {
+            deltas.extend((0..count).map(|j| word(at + 2 + 2 * j)));
+            at += 2 + 2 * count;
+        }
+    }
+
+    assert_eq!(2 * deltas.len(), last.len());
+    deltas.iter().zip(last.chunks(2))
+        .flat_map(|(delta, pixel)| (delta ^ u16::from_le_bytes([pixel[0], pixel[1]])).to_le_bytes())
+        .collect()
+}
+
+/// Packs `pixels` against `last`, checks they decode back and returns the
+/// packets.
+fn round_trip(pixels: &[u16], last: &[u16]) -> Vec<u8> {
+    let bytes = |words: &[u16]| words.iter().flat_map(|word| word.to_le_bytes()).collect::<Vec<u8>>();
+    let (pixels, last) = (bytes(pixels), bytes(last));
+    let mut packets = Vec::new();
+
+    pack(&pixels, &last, &mut packets);
+    assert_eq!(unpack(&packets, &last), pixels);
+    packets
+}
+
+/// Control words of `packets`, in order.
+fn controls(packets: &[u8]) -> Vec<u16> {
+    let mut words = Vec::new();
+    let mut at = 0;
+
+    while at < packets.len() {
+        let control = u16::from_le_bytes([packets[at], packets[at + 1]]);
+        words.push(control);
+        at += if control & 0x8000 != 0 { 4 } else { 2 + 2 * ((control & 0x7FFF) as usize + 1) };
+    }
+    words
+}
+
+#[test]
+pub fn test_pack_literals() {
+    let pixels: Vec<u16> = (0..100).map(|i| i * 7 + 1).collect();
+    let packets = round_trip(&pixels, &[0; 100]);
+
+    assert_eq!(controls(&packets), [99]);
+}
+
+#[test]
+pub fn test_pack_runs() {
+    let last: Vec<u16> = (0..64).map(|i| i * 3).collect();
+    let pixels: Vec<u16> = last.iter().map(|pixel| pixel ^ 0x1234).collect();
+
+    // Unchanged pixels are a run of zero
+    assert_eq!(controls(&round_trip(&last, &last)), [0x8000 | 63]);
+    assert_eq!(controls(&round_trip(&pixels, &last)), [0x8000 | 63]);
+}
+
+#[test]
+pub fn test_pack_mixed() {
+    let mut pixels = vec![5u16; 10];
+    pixels.extend([1, 2, 3, 3, 4]);
+    pixels.extend([9; 3]);
+
+    assert_eq!(controls(&round_trip(&pixels, &[0; 18])), [0x8000 | 9, 4, 0x8000 | 2]);
+}
+
+#[test]
+pub fn test_pack_limits() {
+    // A run at the limit, then tails of one and two pixels
+    for tail in 0..3 {
+        let mut pixels = vec![0x0F0Fu16; PACKET_MAX];
+        pixels.extend((0..tail).map(|i| i as u16));
+        let packets = round_trip(&pixels, &vec![0; pixels.len()]);
+
+        let mut expected = vec![0xFFFF];
+        if tail > 0 {
+            expected.push(tail - 1);
+        }
+        assert_eq!(controls(&packets), expected);
+    }
+
+    // A run one past the limit leaves a single repeated pixel
+    let pixels = vec![7u16; PACKET_MAX + 1];
+    assert_eq!(controls(&round_trip(&pixels, &vec![0; PACKET_MAX + 1])), [0xFFFF, 0]);
+
+    // Literals past the limit split into a second packet
+    let pixels: Vec<u16> = (0..PACKET_MAX + 2).map(|i| i as u16).collect();
+    assert_eq!(controls(&round_trip(&pixels, &vec![0; PACKET_MAX + 2])), [0x7FFF, 1]);
+}
+
+#[test]
+pub fn test_pack_short() {
+    assert_eq!(controls(&round_trip(&[3], &[0])), [0]);
+    assert_eq!(controls(&round_trip(&[3, 3], &[0, 0])), [1]);
+    assert!(round_trip(&[], &[]).is_empty());
+}
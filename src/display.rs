@@ -0,0 +1,264 @@
+//! Handoff of the guest framebuffer from the CPU thread to the presenter.
+//!
+//! Until the guest presents a frame, the presenter uploads the lines the
+//! guest has written straight from real memory, and may catch a frame half
+//! drawn. A guest that presents each finished frame with the `FramePresent`
+//! coprocessor request has them shown whole: the CPU thread copies the frame
+//! into a back buffer and publishes it with an atomic swap, and the presenter
+//! swaps it for the buffer it showed last. With three buffers neither side
+//! ever waits for the other; frames presented faster than the display shows
+//! them are skipped.
+//!
+//! The framebuffer can also be exported as a POSIX shared memory object that
+//! other processes map read-only. The object's pixels are the guest's
+//! framebuffer itself, so publishing a frame costs no copy, only a bump of
+//! the sequence number in the header in front of them.
+
+use std::cell::UnsafeCell;
+use std::sync::atomic::{AtomicBool, AtomicU64, AtomicUsize, Ordering};
+use std::sync::{Mutex, OnceLock};
+
+use crate::{capture, memory, processor, FRAMEBUFFER, FRAME_HEIGHT, FRAME_PITCH, FRAME_SIZE, FRAME_WIDTH};
+
+#[cfg(test)]
+mod tests;
+
+/// Watched pages in the framebuffer, which starts on a page boundary.
+const PAGES: usize = FRAME_SIZE.div_ceil(memory::WATCH_PAGE);
+const WORDS: usize = PAGES.div_ceil(64);
+
+/// Set in `PENDING` until the presenter takes the buffer it names.
+const FRESH: usize = 4;
+
+/// A presented frame and the pages changed since the frame the presenter
+/// took before it.
+struct Buffer {
+    pixels: Vec<u8>,
+    changed: [u64; WORDS]
+}
+
+/// Each buffer is owned by one side at a time: the CPU thread's back buffer,
+/// the pending buffer, which neither writes, and the presenter's front
+/// buffer. Ownership changes only through the swaps of `PENDING`.
+struct Buffers([UnsafeCell<Buffer>; 3]);
+
+unsafe impl Sync for Buffers {}
+
+static BUFFERS: OnceLock<Buffers> = OnceLock::new();
+static PENDING: AtomicUsize = AtomicUsize::new(1);
+static FRONT: AtomicUsize = AtomicUsize::new(0);
+static PRESENTING: AtomicBool = AtomicBool::new(false);
+
+/// Pages written since the presenter last looked, before the guest presents.
+#[allow(clippy::declare_interior_mutable_const)]
+const CLEAN: AtomicU64 = AtomicU64::new(0);
+static LIVE: [AtomicU64; WORDS] = [CLEAN; WORDS];
+
+/// State of the CPU thread side, which only it locks.
+struct Producer {
+    back: usize,
+    /// Pages of each buffer older than the guest's framebuffer.
+    stale: [[u64; WORDS]; 3],
+    /// Changes the next frame published has besides its own: every page
+    /// until the first, as the presenter starts from the live framebuffer.
+    carry: [u64; WORDS]
+}
+
+static PRODUCER: Mutex<Producer> = Mutex::new(Producer {
+    back: 2,
+    stale: [[u64::MAX; WORDS]; 3],
+    carry: [u64::MAX; WORDS]
+});
+
+/// Identifies an exported framebuffer, "YFB1" in memory order.
+const SHM_MAGIC: u32 = u32::from_le_bytes(*b"YFB1");
+const SHM_VERSION: u32 = 1;
+/// Pixel format of an exported framebuffer: little-endian RGB565.
+const SHM_RGB565: u32 = 1;
+
+/// Start of the shared memory object of an exported framebuffer, which is
+/// padded to a host page; the pixels follow at `offset` bytes. `sequence`
+/// counts the frames published: the frames the guest presents, or if it
+/// never does, the slices the presenter is shown. As the pixels are written
+/// by the guest as it draws, a reader that reads `sequence` before and after
+/// copying them knows whether a frame ended during the copy.
+#[repr(C)]
+struct ShmHeader {
+    magic: u32,
+    version: u32,
+    sequence: AtomicU64,
+    format: u32,
+    width: u32,
+    height: u32,
+    pitch: u32,
+    offset: u32
+}
+
+static EXPORT: OnceLock<&'static ShmHeader> = OnceLock::new();
+
+/// Exports the framebuffer as the POSIX shared memory object `name`, such as
+/// "/yardland". Called before the CPU starts.
+pub fn export(name: &str) -> Result<(), String> {
+    let offset = unsafe { libc::sysconf(libc::_SC_PAGESIZE) } as usize;
+    let header = memory::map_shm(name, FRAMEBUFFER, FRAME_SIZE, offset)?;
+
+    assert!(std::mem::size_of::<ShmHeader>() <= header.len());
+    let header = unsafe { &mut *(header.as_mut_ptr() as *mut ShmHeader) };
+
+    *header = ShmHeader {
+        magic: SHM_MAGIC,
+        version: SHM_VERSION,
+        sequence: AtomicU64::new(0),
+        format: SHM_RGB565,
+        width: FRAME_WIDTH as u32,
+        height: FRAME_HEIGHT as u32,
+        pitch: FRAME_PITCH as u32,
+        offset: offset as u32
+    };
+    EXPORT.set(header).map_err(|_| String::from("already exported"))
+}
+
+/// Counts a frame published to readers of the exported framebuffer and
+/// offers it for capture.
+fn publish() {
+    if let Some(header) = EXPORT.get() {
+        header.sequence.fetch_add(1, Ordering::Release);
+    }
+    capture::frame();
+}
+
+/// Makes the pages written in the last slice of cycles visible to the
+/// presenter, unless the guest presents its frames, after the tile and sprite
+/// device draws its frame. Called on the CPU thread between runs.
+pub fn end_slice() {
+    if PRESENTING.load(Ordering::Relaxed) {
+        return
+    }
+    processor::render_ppu();
+    publish();
+
+    for (word, bits) in LIVE.iter().zip(memory::collect_dirty()) {
+        if bits != 0 {
+            word.fetch_or(bits, Ordering::Release);
+        }
+    }
+}
+
+/// Publishes the guest's framebuffer as a finished frame, after the tile and
+/// sprite device draws into it. Called on the CPU thread for the
+/// `FramePresent` request; it copies the pages the back buffer is missing and
+/// never waits for the presenter.
+pub fn present() {
+    let buffers = BUFFERS.get_or_init(|| Buffers(std::array::from_fn(|_| UnsafeCell::new(Buffer {
+        pixels: vec![0; FRAME_SIZE],
+        changed: [0; WORDS]
+    }))));
+    let mut producer = PRODUCER.lock().unwrap();
+    let producer = &mut *producer;
+
+    PRESENTING.store(true, Ordering::Relaxed);
+    processor::render_ppu();
+
+    let mut dirty = [0u64; WORDS];
+    let collected = memory::collect_dirty();
+
+    if collected.is_empty() {
+        dirty = [u64::MAX; WORDS];
+    } else {
+        dirty.iter_mut().zip(collected).for_each(|(word, bits)| *word = bits);
+    }
+
+    for stale in producer.stale.iter_mut() {
+        stale.iter_mut().zip(dirty).for_each(|(word, bits)| *word |= bits);
+    }
+
+    let back = producer.back;
+    let buffer = unsafe { &mut *buffers.0[back].get() };
+
+    for_runs(&producer.stale[back], |first, lines| {
+        let range = first * FRAME_PITCH..(first + lines) * FRAME_PITCH;
+
+        memory::read_real(FRAMEBUFFER + range.start as u32, &mut buffer.pixels[range]);
+    });
+    producer.stale[back] = [0; WORDS];
+
+    let carry = producer.carry;
+
+    // A frame the presenter skipped passes its changes on to this one
+    let previous = offer(&PENDING, back, |skipped| {
+        let skipped = skipped.map(|index| unsafe { (*buffers.0[index].get()).changed });
+
+        for (i, word) in buffer.changed.iter_mut().enumerate() {
+            *word = dirty[i] | carry[i] | skipped.map_or(0, |changed| changed[i]);
+        }
+    });
+    publish();
+
+    producer.back = previous;
+    producer.carry = [0; WORDS];
+}
+
+/// Makes `back` the fresh pending buffer and returns the buffer it replaces,
+/// which becomes the CPU thread's back buffer. `fill` sets the changes of
+/// `back` before it is offered, given the pending buffer if the presenter
+/// has not taken it, whose changes the presenter would then never see. If
+/// the presenter takes it meanwhile the offer fails and `fill` runs again.
+fn offer(pending: &AtomicUsize, back: usize, mut fill: impl FnMut(Option<usize>)) -> usize {
+    let mut previous = pending.load(Ordering::Acquire);
+
+    loop {
+        fill((previous & FRESH != 0).then_some(previous & !FRESH));
+
+        match pending.compare_exchange(previous, back | FRESH, Ordering::AcqRel, Ordering::Acquire) {
+            Ok(_) => return previous & !FRESH,
+            Err(current) => previous = current
+        }
+    }
+}
+
+/// Passes the lines changed since the last call to `upload` as the first
+/// line, the number of lines and their pixels, `FRAME_PITCH` bytes a line.
+/// Called on the presenter thread.
+pub fn update(mut upload: impl FnMut(usize, usize, &[u8])) {
+    if PENDING.load(Ordering::Acquire) & FRESH != 0 {
+        let front = PENDING.swap(FRONT.load(Ordering::Relaxed), Ordering::AcqRel) & !FRESH;
+        let buffer = unsafe { &*BUFFERS.get().unwrap().0[front].get() };
+
+        FRONT.store(front, Ordering::Relaxed);
+        for_runs(&buffer.changed, |first, lines| {
+            upload(first, lines, &buffer.pixels[first * FRAME_PITCH..(first + lines) * FRAME_PITCH]);
+        });
+        return
+    }
+
+    if !PRESENTING.load(Ordering::Relaxed) {
+        let bits: Vec<u64> = LIVE.iter().map(|word| word.swap(0, Ordering::Acquire)).collect();
+
+        for_runs(&bits, |first, lines| {
+            // The slice is copied into the texture and dropped at once
+            upload(first, lines, unsafe { memory::view(FRAMEBUFFER + (first * FRAME_PITCH) as u32, lines * FRAME_PITCH) });
+        });
+    }
+}
+
+/// Calls `f` with the first line and number of lines of each run of pages
+/// set in `bits`.
+fn for_runs(bits: &[u64], mut f: impl FnMut(usize, usize)) {
+    let mut first = None;
+
+    for page in 0..=PAGES {
+        let set = page < PAGES && bits[page / 64] >> (page % 64) & 1 != 0;
+
+        match (first, set) {
+            (None, true) => first = Some(page),
+            (Some(start), false) => {
+                let line = start * memory::WATCH_PAGE / FRAME_PITCH;
+                let end = (page * memory::WATCH_PAGE).div_ceil(FRAME_PITCH).min(FRAME_HEIGHT);
+
+                f(line, end - line);
+                first = None;
+            },
+            _ => {}
+        }
+    }
+}
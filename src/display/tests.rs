@@ -0,0 +1,78 @@
+use std::sync::atomic::{AtomicUsize, Ordering};
+
+use super::{offer, FRESH};
+
+/// Publishes a frame with changes `dirty` from `back` the way `present`
+/// does, keeping each buffer's changes in `changed`.
+fn publish(pending: &AtomicUsize, changed: &mut [u64; 3], back: usize, dirty: u64) -> usize {
+    offer(pending, back, |skipped| {
+        changed[back] = dirty | skipped.map_or(0, |index| changed[index]);
+    })
+}
+
+/// Takes the pending frame the way `update` does, giving back `front`.
+fn take(pending: &AtomicUsize, front: usize) -> usize {
+    pending.swap(front, Ordering::AcqRel) & !FRESH
+}
+
+#[test]
+pub fn test_offer_taken() {
+    let pending = AtomicUsize::new(1);
+    let mut seen = Vec::new();
+
+    assert_eq!(offer(&pending, 2, |skipped| seen.push(skipped)), 1);
+    assert_eq!(seen, [None]);
+    assert_eq!(pending.load(Ordering::Relaxed), 2 | FRESH);
+}
+
+#[test]
+pub fn test_offer_skipped() {
+    let pending = AtomicUsize::new(1 | FRESH);
+    let mut seen = Vec::new();
+
+    assert_eq!(offer(&pending, 2, |skipped| seen.push(skipped)), 1);
+    assert_eq!(seen, [Some(1)]);
+    assert_eq!(pending.load(Ordering::Relaxed), 2 | FRESH);
+}
+
+#[test]
+pub fn test_offer_taken_meanwhile() {
+    let pending = AtomicUsize::new(1 | FRESH);
+    let mut seen = Vec::new();
+
+    // The presenter takes the skipped frame while its changes are folded in
+    let previous = offer(&pending, 2, |skipped| {
+        if seen.is_empty() {
+            assert_eq!(take(&pending, 0), 1);
+        }
+        seen.push(skipped);
+    });
+
+    assert_eq!(previous, 0);
+    assert_eq!(seen, [Some(1), None]);
+    assert_eq!(pending.load(Ordering::Relaxed), 2 | FRESH);
+}
+
+#[test]
+pub fn test_skipped_changes_reach_presenter() {
+    let pending = AtomicUsize::new(1);
+    let mut changed = [0u64; 3];
+    let mut back = 2;
+    let mut front = 0;
+
+    // Three frames presented before the presenter looks
+    for dirty in [1, 2, 4] {
+        back = publish(&pending, &mut changed, back, dirty);
+    }
+    front = take(&pending, front);
+    assert_eq!(changed[front], 7);
+
+    // Taken as soon as presented, so nothing is carried
+    back = publish(&pending, &mut changed, back, 8);
+    front = take(&pending, front);
+    assert_eq!(changed[front], 8);
+
+    back = publish(&pending, &mut changed, back, 16);
+    publish(&pending, &mut changed, back, 32);
+    assert_eq!(changed[take(&pending, front)], 48);
+}
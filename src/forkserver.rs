@@ -0,0 +1,104 @@
+//! Fork-server mode: boots the guest once up to a boot-complete marker, then
+//! forks a copy-on-write child for each test that continues from the booted
+//! state, so a test costs a fork instead of a full boot.
+//!
+//! Tests are read from stdin, one per line. Each child runs the guest until
+//! it executes STP or uses up its cycles and exits with `EXIT_STOPPED` or
+//! `EXIT_TIMEOUT`; the server prints one result line per test. Children
+//! see the non-volatile banks as they were at the marker, but their writes
+//! to them are private and never reach the files.
+
+use std::io::{self, BufRead, Write};
+use std::time::Instant;
+
+use crate::{memory, processor};
+
+/// Exit status of a test whose guest executed STP.
+pub const EXIT_STOPPED: i32 = 0;
+/// Exit status of a test that used up its cycles.
+pub const EXIT_TIMEOUT: i32 = 2;
+/// Exit status of a test that could not be set up.
+pub const EXIT_FAILED: i32 = 3;
+
+/// Guest cycles allowed for boot when no `--boot-cycles` is given.
+pub const DEFAULT_BOOT_CYCLES: u64 = 1_000_000_000;
+/// Guest cycles allowed per test when no `--test-cycles` is given.
+pub const DEFAULT_TEST_CYCLES: u64 = 100_000_000;
+
+pub struct Config {
+    /// Signature byte of the `WDM` that marks the end of boot.
+    pub marker: Option<u8>,
+    /// `PBR:PC` of the instruction that marks the end of boot.
+    pub pc: Option<u32>,
+    /// Guest cycles allowed for boot.
+    pub boot_cycles: u64,
+    /// Guest cycles allowed per test.
+    pub test_cycles: u64,
+    /// If set, each test's line is written NUL-terminated at this real
+    /// address before the child continues.
+    pub input: Option<u32>
+}
+
+pub fn run(options: processor::Options, config: Config) {
+    let start = Instant::now();
+    let mut processor = processor::Processor::new(options);
+
+    processor.set_marker(config.marker, config.pc);
+
+    let running = processor.run_until(config.boot_cycles);
+    if !processor.marked() {
+        println!("FORKSERVER: BOOT {} BEFORE MARKER", if running { "TIMED OUT" } else { "STOPPED" });
+        return
+    }
+
+    let booted = processor::get_metrics().cycles;
+    println!("FORKSERVER: BOOTED CYCLES {{{}}} MICROS {{{}}}", booted, start.elapsed().as_micros());
+
+    for line in io::stdin().lock().lines() {
+        let Ok(line) = line else { break };
+
+        // Anything buffered would be written again by the child
+        io::stdout().flush().ok();
+
+        let start = Instant::now();
+
+        match unsafe { libc::fork() } {
+            -1 => {
+                println!("FORKSERVER: CANNOT FORK: {}", io::Error::last_os_error());
+                break
+            },
+            0 => {
+                if let Err(error) = memory::detach_nvram() {
+                    println!("FORKSERVER: CANNOT DETACH NVRAM: {}", error);
+                    io::stdout().flush().ok();
+                    unsafe { libc::_exit(EXIT_FAILED) }
+                }
+
+                if let Some(input) = config.input {
+                    for (i, byte) in line.bytes().chain(std::iter::once(0)).enumerate() {
+                        memory::writeb(input + i as u32, byte);
+                    }
+                }
+
+                let status = if processor.run_until(booted + config.test_cycles) { EXIT_TIMEOUT } else { EXIT_STOPPED };
+
+                io::stdout().flush().ok();
+                unsafe { libc::_exit(status) }
+            },
+            child => {
+                let mut status = 0;
+                unsafe { libc::waitpid(child, &mut status, 0) };
+
+                let result = if libc::WIFEXITED(status) {
+                    format!("EXIT {{{}}}", libc::WEXITSTATUS(status))
+                } else {
+                    format!("SIGNAL {{{}}}", libc::WTERMSIG(status))
+                };
+
+                println!("FORKSERVER: TEST {{{}}} {} MICROS {{{}}}", line, result, start.elapsed().as_micros());
+            }
+        }
+    }
+
+    processor.finish();
+}
@@ -0,0 +1,88 @@
+//! Headless mode: runs the CPU without SDL for a fixed number of cycles or
+//! frames and reports end-to-end throughput.
+
+use std::fs;
+use std::time::Instant;
+
+use crate::{display, memory, processor, FRAMEBUFFER, FRAME_SIZE};
+
+/// Guest cycles per frame when no `--frame-cycles` is given, 14 MHz at 60 Hz.
+pub const DEFAULT_FRAME_CYCLES: u64 = 14_000_000 / 60;
+
+pub struct Config {
+    /// Total guest cycles to run, overrides `frames` if set.
+    pub cycles: Option<u64>,
+    /// Frames to run.
+    pub frames: u64,
+    /// Guest cycles per frame.
+    pub frame_cycles: u64,
+    /// If true, the last frame is hashed.
+    pub hash: bool,
+    /// If set, the last frame is written to this path.
+    pub dump: Option<String>
+}
+
+/// FNV-1a, stable across hosts and runs.
+fn hash(bytes: &[u8]) -> u64 {
+    bytes.iter().fold(0xcbf29ce484222325u64, |hash, byte| {
+        (hash ^ *byte as u64).wrapping_mul(0x100000001b3)
+    })
+}
+
+pub fn run(options: processor::Options, config: Config) {
+    let total = config.cycles.unwrap_or(config.frames * config.frame_cycles);
+    let mut frames = 0u64;
+
+    let start = Instant::now();
+    let mut processor = processor::Processor::new(options);
+
+    let mut frame_end = 0u64;
+    while frame_end < total {
+        frame_end = (frame_end + config.frame_cycles).min(total);
+
+        let running = processor.run_until(frame_end);
+        display::end_slice();
+        frames += 1;
+
+        if !running {
+            break
+        }
+    }
+
+    let elapsed = start.elapsed().as_secs_f64();
+    let metrics = processor::get_metrics();
+    let stats = processor.stats();
+
+    // The last frame is copied out only if it is wanted, outside the timing
+    let mut frame = Vec::new();
+    if config.hash || config.dump.is_some() {
+        frame = vec![0u8; FRAME_SIZE];
+        memory::dma_moveb_out_r(frame.as_mut_slice(), FRAMEBUFFER, FRAME_SIZE);
+    }
+
+    processor.finish();
+
+    println!("HEADLESS: CYCLES {{{}}} INSTRUCTIONS {{{}}} FRAMES {{{}}} SECONDS {{{:.3}}}",
+        metrics.cycles, metrics.instructions, frames, elapsed);
+    println!("HEADLESS: GUEST MIPS {{{:.2}}} EMULATED MHZ {{{:.2}}} FPS {{{:.2}}}",
+        metrics.instructions as f64 / elapsed / 1e6,
+        metrics.cycles as f64 / elapsed / 1e6,
+        frames as f64 / elapsed);
+
+    if stats.cop_requests != 0 {
+        println!("HEADLESS: COP REQUESTS {{{}}} LATENCY AVG {{{:.2}us}} MAX {{{:.2}us}}",
+            stats.cop_requests,
+            stats.cop_latency.as_secs_f64() * 1e6 / stats.cop_requests as f64,
+            stats.cop_latency_max.as_secs_f64() * 1e6);
+    }
+
+    if config.hash {
+        println!("HEADLESS: FRAME HASH {{{:016X}}}", hash(&frame));
+    }
+
+    if let Some(path) = config.dump {
+        if let Err(error) = fs::write(&path, &frame) {
+            println!("HEADLESS: CANNOT WRITE {{{}}}: {}", path, error);
+        }
+    }
+}
@@ -1,42 +1,153 @@
 mod memory;
 mod processor;
+mod headless;
+mod forkserver;
+mod display;
+mod capture;
 
 use std::thread;
+use std::time::{Duration, Instant};
 use sdl2::{
     render::TextureAccess,
-    pixels::PixelFormatEnum
+    pixels::PixelFormatEnum,
+    rect::Rect
 };
 
+/// Real address of the RGB565 framebuffer.
+pub const FRAMEBUFFER: u32 = 0xA0000;
+/// Framebuffer width in pixels.
+pub const FRAME_WIDTH: usize = 1024;
+/// Bytes per framebuffer line.
+pub const FRAME_PITCH: usize = 2048;
+/// Framebuffer lines.
+pub const FRAME_HEIGHT: usize = 720;
+pub const FRAME_SIZE: usize = FRAME_PITCH * FRAME_HEIGHT;
+
+/// Returns the value following `name` on the command line.
+fn arg_value(args: &[String], name: &str) -> Option<String> {
+    args.iter().position(|arg| arg == name).and_then(|i| args.get(i + 1).cloned())
+}
+
 pub fn main() {
-    let bin = std::fs::read("assets/test/rom.bin").unwrap();
-    memory::dma_moveb_in(bin.as_slice(), 0xF000);
-    let bin = std::fs::read("assets/test.bgr").unwrap();
-    memory::dma_moveb_in(bin.as_slice(), 0x10000);
+    let args: Vec<String> = std::env::args().collect();
+
+    let map = arg_value(&args, "--map").unwrap_or(String::from("assets/test/yardland.cfg"));
+    if let Err(error) = memory::load_map(&map) {
+        println!("MEMORY MAP: CANNOT LOAD {{{}}}: {}", map, error);
+    }
+
+    // The map declares the ROM area rw and the test ROM writes to it, so it is
+    // mapped copy-on-write rather than as ROM
+    memory::map_file("assets/test/rom.bin", 0xF000, true).unwrap();
+    memory::map_file("assets/test.bgr", 0x10000, true).unwrap();
+
+    // --nvram FIRST[-LAST]=PATH keeps real banks FIRST to LAST in a file
+    if let Some(nvram) = arg_value(&args, "--nvram") {
+        if let Err(error) = parse_nvram(&nvram).and_then(|(first, banks, path)| memory::map_nvram(&path, first, banks)) {
+            println!("NVRAM: CANNOT MAP {{{}}}: {}", nvram, error);
+        }
+    }
+
+    // --shm NAME exports the framebuffer as a POSIX shared memory object
+    if let Some(name) = arg_value(&args, "--shm") {
+        if let Err(error) = display::export(&name) {
+            println!("SHM: CANNOT EXPORT {{{}}}: {}", name, error);
+        }
+    }
+
+    // --capture PATH records frames, --capture-format raw|delta and
+    // --capture-rate FPS of guest time select how
+    if let Some(path) = arg_value(&args, "--capture") {
+        let format = match arg_value(&args, "--capture-format").as_deref() {
+            Some("delta") => capture::Format::Delta,
+            _ => capture::Format::Raw
+        };
+        let rate = arg_value(&args, "--capture-rate").and_then(|rate| rate.parse().ok()).unwrap_or(60);
+
+        if let Err(error) = capture::start(&path, format, rate) {
+            println!("CAPTURE: CANNOT START {{{}}}: {}", path, error);
+        }
+    }
+
+    let trace = !args.get(1).map(String::as_str).unwrap_or("F").eq("T");
+    let options = processor::Options {
+        trace,
+        sample_period: std::env::var("YARDLAND_SAMPLE_PERIOD").ok()
+            .and_then(|period| period.parse().ok())
+            .unwrap_or(0),
+        perf_counters: std::env::var("YARDLAND_PERF").is_ok(),
+        coverage: std::env::var("YARDLAND_COVERAGE").ok()
+    };
+
+    if args.iter().any(|arg| arg == "--fork-server") {
+        let number = |name| arg_value(&args, name).and_then(|value| parse_number(&value).ok());
+
+        forkserver::run(options, forkserver::Config {
+            marker: number("--boot-marker").map(|signature| signature as u8),
+            pc: number("--boot-pc"),
+            boot_cycles: arg_value(&args, "--boot-cycles").and_then(|cycles| cycles.parse().ok())
+                .unwrap_or(forkserver::DEFAULT_BOOT_CYCLES),
+            test_cycles: arg_value(&args, "--test-cycles").and_then(|cycles| cycles.parse().ok())
+                .unwrap_or(forkserver::DEFAULT_TEST_CYCLES),
+            input: number("--fork-input")
+        });
+        return
+    }
+
+    if args.iter().any(|arg| arg == "--headless") {
+        headless::run(options, headless::Config {
+            cycles: arg_value(&args, "--cycles").and_then(|cycles| cycles.parse().ok()),
+            frames: arg_value(&args, "--frames").and_then(|frames| frames.parse().ok()).unwrap_or(60),
+            frame_cycles: arg_value(&args, "--frame-cycles").and_then(|cycles| cycles.parse().ok())
+                .unwrap_or(headless::DEFAULT_FRAME_CYCLES),
+            hash: args.iter().any(|arg| arg == "--hash"),
+            dump: arg_value(&args, "--dump")
+        });
+        memory::close_nvram();
+        memory::unlink_shm();
+        return
+    }
 
     let sdl = sdl2::init().unwrap();
     let sdl_video = sdl.video().unwrap();
     let mut event_pump = sdl.event_pump().unwrap();
 
-    let window = sdl_video.window("Yardland", 1024, 720)
+    let window = sdl_video.window("Yardland", FRAME_WIDTH as u32, FRAME_HEIGHT as u32)
         .position_centered()
         .vulkan()
         .build()
         .unwrap();
 
-    let mut canvas = window.into_canvas().accelerated().build().unwrap();
+    let mut canvas = window.into_canvas().accelerated().present_vsync().build().unwrap();
     let texture_creator = canvas.texture_creator();
-    let mut texture = texture_creator.create_texture(Some(PixelFormatEnum::RGB565), TextureAccess::Streaming, 1024, 720).unwrap();
+    let mut texture = texture_creator.create_texture(Some(PixelFormatEnum::RGB565), TextureAccess::Streaming, FRAME_WIDTH as u32, FRAME_HEIGHT as u32).unwrap();
 
-    let trace = !std::env::args().nth(1).unwrap_or(String::from("F")).eq("T");
+    // Only the lines the guest writes are uploaded
+    memory::watch(FRAMEBUFFER, FRAME_SIZE);
 
-    thread::spawn(move || processor::processor_func(trace));
+    thread::spawn(move || processor::processor_func(options));
+
+    let metrics_interval = std::env::var("YARDLAND_METRICS").ok()
+        .and_then(|secs| secs.parse().ok())
+        .map(Duration::from_secs);
+    let mut metrics_due = Instant::now();
 
     'main: loop {
+        if let Some(interval) = metrics_interval {
+            if Instant::now() >= metrics_due {
+                print_metrics(&processor::get_metrics());
+                metrics_due += interval;
+            }
+        }
+
         for event in event_pump.poll_iter() {
             use sdl2::event::Event;
 
             match event {
                 Event::Quit {..} => {
+                    memory::close_nvram();
+                    memory::unlink_shm();
+                    capture::finish();
                     break 'main
                 }
                 _ => {}
@@ -45,12 +156,53 @@ pub fn main() {
 
         canvas.clear();
 
-        texture.with_lock(None, |pixels: &mut [u8], pitch| {
-            memory::dma_moveb_out_r(pixels, 0xA0000, pitch * 720);
-        }).unwrap();
+        display::update(|first, lines, pixels| {
+            texture.update(Rect::new(0, first as i32, FRAME_WIDTH as u32, lines as u32), pixels, FRAME_PITCH).unwrap();
+        });
 
         canvas.copy(&texture, None, None).unwrap();
 
         canvas.present();
     }
 }
+
+/// Parses a decimal or `0x` hexadecimal number.
+fn parse_number(text: &str) -> Result<u32, String> {
+    match text.strip_prefix("0x") {
+        Some(hex) => u32::from_str_radix(hex, 16),
+        None => text.parse()
+    }.map_err(|error| error.to_string())
+}
+
+/// Parses `FIRST[-LAST]=PATH` into the first bank, the number of banks and
+/// the path.
+fn parse_nvram(arg: &str) -> Result<(u32, u32, String), String> {
+    let number = parse_number;
+
+    let (banks, path) = arg.split_once('=').ok_or(String::from("expected FIRST[-LAST]=PATH"))?;
+    let (first, last) = match banks.split_once('-') {
+        Some((first, last)) => (number(first)?, number(last)?),
+        None => (number(banks)?, number(banks)?)
+    };
+
+    if last < first {
+        return Err(String::from("last bank before first"))
+    }
+    Ok((first, last - first + 1, String::from(path)))
+}
+
+fn print_metrics(metrics: &processor::Metrics) {
+    use processor::StopReason;
+
+    println!("METRICS: INSTRUCTIONS {{{}}} CYCLES {{{}}} INTERRUPTS {{{}}}", metrics.instructions, metrics.cycles, metrics.interrupts);
+    println!("METRICS: STOPS COP {{{}}} WAI {{{}}} STP {{{}}}",
+        metrics.stops_for(StopReason::Coprocessor),
+        metrics.stops_for(StopReason::WaitInterrupt),
+        metrics.stops_for(StopReason::Stop));
+    println!("METRICS: RUNNING {{{}ms}} STOPPED {{{}ms}} READS {{{}}} WRITES {{{}}}",
+        metrics.running_ns / 1_000_000, metrics.stopped_ns / 1_000_000, metrics.memory_reads, metrics.memory_writes);
+
+    for (opcode, count) in metrics.cop_requests.iter().enumerate().filter(|(_, count)| **count != 0) {
+        println!("METRICS: COP {{{:X}}} REQUESTS {{{}}}", opcode, count);
+    }
+}
@@ -3,142 +3,541 @@
 #[cfg(test)]
 mod tests;
 
-use std::sync::RwLock;
-use std::collections::HashMap;
-use once_cell::sync::Lazy;
+use std::sync::{mpsc, Mutex, OnceLock};
 
-pub const MEMORY_SIZE: u32 = u32::MAX / 16;
+/// Size of real memory, 4096 banks of 64 KiB.
+pub const MEMORY_SIZE: u32 = 1 << 28;
 
-static mut BUFFER: RwLock<[u8; MEMORY_SIZE as usize]> = RwLock::new([0u8; MEMORY_SIZE as usize]);
-static mut BANK_TABLE: Lazy<RwLock<HashMap<u8, u16>>> = Lazy::new(|| {
-    let mut bank_table = HashMap::new();
-    for i in 0..u8::MAX {
-        bank_table.insert(i, i as u16);
+#[link(name = "emu816")]
+extern "C" {
+    fn emu816_loadMemoryMap(text: *const libc::c_char, memory: *mut u8, size: u32) -> i32;
+    fn emu816_mapHost(start: u32, size: u32, host: *mut u8, writable: bool);
+    fn emu816_translate(addr: u32) -> u32;
+    fn emu816_watch(start: u32, size: u32);
+    fn emu816_takeDirty(start: u32, size: u32, bits: *mut u64);
+}
+
+/// Size of the huge pages requested for real memory.
+const HUGE_PAGE_SIZE: usize = 2 << 20;
+
+/// Host pages backing real memory.
+#[derive(Clone, Copy, Debug, PartialEq)]
+pub enum Backing {
+    /// Explicit 2 MiB pages from the hugetlbfs pool, reserved up front.
+    HugeTlb,
+    /// Transparent huge pages, assembled by the kernel as memory is touched.
+    Transparent,
+    /// Normal host pages.
+    Normal
+}
+
+/// Real memory, reserved with `mmap` but not committed. The kernel commits a
+/// page on its first write; untouched pages read as zero without allocating.
+struct Physical {
+    base: *mut u8,
+    backing: Backing
+}
+
+unsafe impl Send for Physical {}
+unsafe impl Sync for Physical {}
+
+static PHYSICAL: OnceLock<Physical> = OnceLock::new();
+
+/// Reserves `size` bytes aligned to a huge page.
+unsafe fn reserve(size: usize) -> Option<*mut u8> {
+    let raw = libc::mmap(
+        std::ptr::null_mut(),
+        size + HUGE_PAGE_SIZE,
+        libc::PROT_READ | libc::PROT_WRITE,
+        libc::MAP_PRIVATE | libc::MAP_ANONYMOUS | libc::MAP_NORESERVE,
+        -1,
+        0
+    );
+
+    if raw == libc::MAP_FAILED {
+        return None
     }
-    RwLock::new(bank_table)
-});
 
-macro_rules! buffer {
-    [$addr:expr] => {{
-        let buffer = BUFFER.read().unwrap();
-        buffer[$addr]
-    }};
-    ($addr:expr, $byte:expr) => {{
-        let mut buffer = BUFFER.write().unwrap();
-        buffer[$addr] = $byte;
-    }};
+    // Trim the excess either side of the aligned range
+    let start = raw as usize;
+    let aligned = (start + HUGE_PAGE_SIZE - 1) & !(HUGE_PAGE_SIZE - 1);
+
+    if aligned > start {
+        libc::munmap(raw, aligned - start);
+    }
+    if start + HUGE_PAGE_SIZE > aligned {
+        libc::munmap((aligned + size) as *mut libc::c_void, start + HUGE_PAGE_SIZE - aligned);
+    }
+    Some(aligned as *mut u8)
 }
 
-macro_rules! bank_table {
-    [$bank:expr] => {{
-        let bank_table = BANK_TABLE.read().unwrap();
-        bank_table[$bank]
-    }};
-    ($virt:expr, $real:expr) => {{
-        let mut bank_table = BANK_TABLE.write().unwrap();
-        bank_table.insert($virt, $real);
-    }};
+/// Reserves real memory from the hugetlbfs pool. Fails unless the pool holds
+/// enough free pages for all of it.
+unsafe fn reserve_hugetlb(size: usize) -> Option<*mut u8> {
+    let base = libc::mmap(
+        std::ptr::null_mut(),
+        size,
+        libc::PROT_READ | libc::PROT_WRITE,
+        libc::MAP_PRIVATE | libc::MAP_ANONYMOUS | libc::MAP_HUGETLB,
+        -1,
+        0
+    );
+
+    if base == libc::MAP_FAILED { None } else { Some(base as *mut u8) }
+}
+
+/// Returns real memory, reserving it on first use.
+///
+/// `YARDLAND_HUGEPAGES` selects the backing: `explicit` tries the hugetlbfs
+/// pool first, `off` uses normal pages and anything else (the default) asks
+/// for transparent huge pages. Each falls back to the next when unavailable.
+fn physical() -> &'static Physical {
+    PHYSICAL.get_or_init(|| unsafe {
+        let size = MEMORY_SIZE as usize;
+        let mode = std::env::var("YARDLAND_HUGEPAGES").unwrap_or_default();
+
+        if mode == "explicit" {
+            if let Some(base) = reserve_hugetlb(size) {
+                return Physical { base, backing: Backing::HugeTlb }
+            }
+        }
+
+        let base = match reserve(size) {
+            Some(base) => base,
+            None => panic!("cannot reserve {} bytes of real memory: {}", MEMORY_SIZE, std::io::Error::last_os_error())
+        };
+
+        let transparent = mode != "off"
+            && libc::madvise(base as *mut libc::c_void, size, libc::MADV_HUGEPAGE) == 0
+            && !std::fs::read_to_string("/sys/kernel/mm/transparent_hugepage/enabled")
+                .map(|enabled| enabled.contains("[never]"))
+                .unwrap_or(true);
+
+        Physical { base, backing: if transparent { Backing::Transparent } else { Backing::Normal } }
+    })
 }
 
+/// Returns the host pages backing real memory.
+pub fn backing() -> Backing {
+    physical().backing
+}
+
+/// Returns the NUMA node of the CPU the calling thread is running on.
+fn current_node() -> Option<u32> {
+    let cpu = unsafe { libc::sched_getcpu() };
+    if cpu < 0 {
+        return None
+    }
+
+    std::fs::read_dir(format!("/sys/devices/system/cpu/cpu{}", cpu)).ok()?
+        .filter_map(|entry| entry.ok())
+        .find_map(|entry| entry.file_name().to_str()?.strip_prefix("node")?.parse().ok())
+}
+
+/// Prefers the NUMA node of the calling thread for real memory, moving the
+/// pages already committed. Called from the CPU thread so the memory it
+/// touches is local to it. Returns the node, or `None` if it is unknown.
+pub fn bind_to_current_node() -> Option<u32> {
+    const MPOL_PREFERRED: libc::c_long = 1;
+    const MPOL_MF_MOVE: libc::c_long = 1 << 1;
+
+    let node = current_node()?;
+    if node >= 64 {
+        return None
+    }
+
+    let mask: u64 = 1 << node;
+    let result = unsafe {
+        libc::syscall(
+            libc::SYS_mbind,
+            physical().base,
+            MEMORY_SIZE as libc::c_long,
+            MPOL_PREFERRED,
+            &mask as *const u64,
+            65 as libc::c_long,
+            MPOL_MF_MOVE
+        )
+    };
+
+    if result == 0 { Some(node) } else { None }
+}
+
+/// Returns the host address of `size` bytes of real memory starting at a
+/// real address.
+///
+/// The CPU thread writes real memory without locking, so no reference to it
+/// is kept: callers copy through the pointer.
+fn host(addr: usize, size: usize) -> *mut u8 {
+    assert!(addr + size <= MEMORY_SIZE as usize, "real address {:X} out of range", addr + size);
+
+    unsafe { physical().base.add(addr) }
+}
+
+/// Copies real memory starting at a real address into `dest`.
+fn copy_out(addr: usize, dest: &mut [u8]) {
+    unsafe {
+        std::ptr::copy_nonoverlapping(host(addr, dest.len()), dest.as_mut_ptr(), dest.len());
+    }
+}
+
+/// Copies `src` into real memory starting at a real address.
+fn copy_in(addr: usize, src: &[u8]) {
+    unsafe {
+        std::ptr::copy_nonoverlapping(src.as_ptr(), host(addr, src.len()), src.len());
+    }
+}
+
+/// Translates a CPU address through the page table of the emulator core.
 macro_rules! real_addr {
     ($virt:expr) => {{
-        let virt_bank = ($virt >> 16) as u8;
-        let real_bank = bank_table![&virt_bank];
-        let mut real_addr = (real_bank as u32) << 16;
-        real_addr |= ($virt & u16::MAX as u32) as u32;
-        real_addr as usize
+        emu816_translate($virt) as usize
     }};
 }
 
-pub fn map_bank(virt: u8, real: u16) {
-    println!("MMU MAP BANK: VIRT {{{:X}}} REAL {{{:X}}}", virt, real);
+/// Configures the CPU memory region table from an ld65 style memory map.
+///
+/// RAM and ROM areas are read and written by the CPU directly in real memory,
+/// without going through `readb`/`writeb`. Returns the number of areas mapped.
+pub fn load_map(path: &str) -> Result<i32, String> {
+    let text = std::fs::read_to_string(path).map_err(|error| error.to_string())?;
+    let text = std::ffi::CString::new(text).map_err(|error| error.to_string())?;
 
     unsafe {
-        bank_table!(virt, real);
+        match emu816_loadMemoryMap(text.as_ptr(), physical().base, MEMORY_SIZE) {
+            -1 => Err(String::from("syntax error")),
+            mapped => Ok(mapped)
+        }
     }
 }
 
-pub fn readb(addr: u32) -> u8 {
-    unsafe {
-        buffer![real_addr!(addr)]
+/// Maps a file into real memory at a real address with `MAP_PRIVATE`, so the
+/// pages are shared with the page cache until written and copied on write.
+/// Without `writable` the pages become ROM and CPU writes to them are ignored.
+///
+/// Falls back to reading the file into memory when `start` is not aligned to
+/// a host page or the pages cannot be replaced (hugetlbfs backing). Returns
+/// the size of the file.
+pub fn map_file(path: &str, start: u32, writable: bool) -> Result<usize, String> {
+    use std::os::unix::io::AsRawFd;
+
+    let file = std::fs::File::open(path).map_err(|error| error.to_string())?;
+    let size = file.metadata().map_err(|error| error.to_string())?.len() as usize;
+
+    if start as usize + size > MEMORY_SIZE as usize {
+        return Err(String::from("file does not fit in real memory"))
     }
+    if size == 0 {
+        return Ok(0)
+    }
+
+    let host = host(start as usize, size);
+    let page_size = unsafe { libc::sysconf(libc::_SC_PAGESIZE) } as usize;
+
+    let mapped = start as usize % page_size == 0 && unsafe {
+        libc::mmap(
+            host as *mut libc::c_void,
+            size,
+            libc::PROT_READ | libc::PROT_WRITE,
+            libc::MAP_PRIVATE | libc::MAP_FIXED,
+            file.as_raw_fd(),
+            0
+        ) != libc::MAP_FAILED
+    };
+
+    if !mapped {
+        copy_in(start as usize, &std::fs::read(path).map_err(|error| error.to_string())?);
+    }
+
+    if !writable {
+        unsafe {
+            emu816_mapHost(start, size as u32, host, false);
+        }
+    }
+    Ok(size)
 }
 
-pub fn writeb(addr: u32, byte: u8) {
-    unsafe {
-        buffer!(real_addr!(addr), byte);
+/// Granularity of write watching, the page size of the core.
+pub const WATCH_PAGE: usize = 4096;
+
+/// The range of real memory whose writes are watched.
+static WATCH: OnceLock<(u32, usize)> = OnceLock::new();
+
+/// Watches writes to a range of real memory, so `collect_dirty` can tell
+/// which parts changed. Only one range can be watched. Writes by the host
+/// through this module are not seen.
+pub fn watch(start: u32, size: usize) {
+    if WATCH.set((start, size)).is_ok() {
+        unsafe {
+            emu816_watch(start, size as u32);
+        }
     }
 }
 
-pub fn dma_moveb_out_v(dest: &mut [u8], start: u32, size: usize) {
+/// Returns one bit for each page of the watched range written by the guest
+/// since the last call, the page holding its start in bit 0 of the first
+/// word, or nothing if no range is watched. Must be called on the CPU thread
+/// between runs.
+pub fn collect_dirty() -> Vec<u64> {
+    let Some(&(start, size)) = WATCH.get() else { return Vec::new() };
+    let pages = (start as usize % WATCH_PAGE + size).div_ceil(WATCH_PAGE);
+    let mut bits = vec![0u64; pages.div_ceil(64)];
+
     unsafe {
-        let real_addr = real_addr!(start);
-        let buffer = BUFFER.read().unwrap();
-        dest.copy_from_slice(&buffer[real_addr..(real_addr + size)]);
+        emu816_takeDirty(start, size as u32, bits.as_mut_ptr());
     }
+    bits
 }
 
-pub fn dma_moveb_out_r(dest: &mut [u8], start: u32, size: usize) {
+/// Copies real memory starting at a real address into `dest`. The CPU
+/// thread may write it at the same time.
+pub fn read_real(start: u32, dest: &mut [u8]) {
+    copy_out(start as usize, dest);
+}
+
+/// Returns real memory directly, for readers that copy it out themselves.
+///
+/// # Safety
+///
+/// The CPU thread may write the memory under the slice, so the caller must
+/// only copy out of it, must not rely on it holding still and must drop it
+/// before real memory is remapped.
+pub unsafe fn view(start: u32, size: usize) -> &'static [u8] {
+    std::slice::from_raw_parts(host(start as usize, size), size)
+}
+
+/// A range of real memory backed by a shared file mapping.
+struct Nvram {
+    base: usize,
+    size: usize,
+    file: std::fs::File
+}
+
+static NVRAM: Mutex<Vec<Nvram>> = Mutex::new(Vec::new());
+static FLUSHER: OnceLock<Mutex<mpsc::Sender<()>>> = OnceLock::new();
+
+/// Makes real banks `first..first + banks` non-volatile by mapping them
+/// shared from a file, created or resized to fit. The file holds the banks'
+/// contents across runs and the CPU writes it directly.
+pub fn map_nvram(path: &str, first: u32, banks: u32) -> Result<(), String> {
+    use std::os::unix::io::AsRawFd;
+
+    let start = first as usize * 0x10000;
+    let size = banks as usize * 0x10000;
+
+    if size == 0 || start + size > MEMORY_SIZE as usize {
+        return Err(String::from("banks out of range"))
+    }
+
+    let file = std::fs::OpenOptions::new().read(true).write(true).create(true).truncate(false).open(path)
+        .map_err(|error| error.to_string())?;
+    file.set_len(size as u64).map_err(|error| error.to_string())?;
+
+    let host = host(start, size);
+    let mapped = unsafe {
+        libc::mmap(
+            host as *mut libc::c_void,
+            size,
+            libc::PROT_READ | libc::PROT_WRITE,
+            libc::MAP_SHARED | libc::MAP_FIXED,
+            file.as_raw_fd(),
+            0
+        )
+    };
+
+    if mapped == libc::MAP_FAILED {
+        return Err(std::io::Error::last_os_error().to_string())
+    }
+
     unsafe {
-        let real_addr = start as usize;
-        let buffer = BUFFER.read().unwrap();
-        dest.copy_from_slice(&buffer[real_addr..(real_addr + size)]);
+        emu816_mapHost(start as u32, size as u32, host, true);
     }
+    NVRAM.lock().unwrap().push(Nvram { base: host as usize, size, file });
+    Ok(())
 }
 
-pub fn dma_moveb_in(src: &[u8], start: u32) {
+/// Names of the shared memory objects mapped, to remove at exit.
+static SHM: Mutex<Vec<std::ffi::CString>> = Mutex::new(Vec::new());
+
+/// Maps a range of real memory from a POSIX shared memory object, so other
+/// processes can map the guest's writes to it. Any object left by an earlier
+/// run is truncated, so the range keeps its contents and the header starts
+/// zeroed; `unlink_shm` removes the object at exit. The object holds `header`
+/// bytes, a multiple of the host page size, followed by the range; the CPU
+/// writes the range directly. Returns the header. With explicit huge pages
+/// the range must start and end on a 2 MiB boundary, which the framebuffer
+/// does not.
+pub fn map_shm(name: &str, start: u32, size: usize, header: usize) -> Result<&'static mut [u8], String> {
+    if size == 0 || start as usize + size > MEMORY_SIZE as usize {
+        return Err(String::from("range out of real memory"))
+    }
+    // Explicit huge pages can only be replaced whole
+    if backing() == Backing::HugeTlb && (start as usize % HUGE_PAGE_SIZE != 0 || size % HUGE_PAGE_SIZE != 0) {
+        return Err(String::from("range not on 2 MiB pages, which YARDLAND_HUGEPAGES=explicit needs"))
+    }
+
+    let name = std::ffi::CString::new(name).map_err(|error| error.to_string())?;
+    let host = host(start as usize, size);
+    let mut contents = vec![0; size];
+
+    copy_out(start as usize, &mut contents);
+
     unsafe {
-        let real_addr = real_addr!(start);
-        let mut buffer = BUFFER.write().unwrap();
-        buffer[real_addr..(real_addr + src.len())].copy_from_slice(src);
+        let fd = libc::shm_open(name.as_ptr(), libc::O_RDWR | libc::O_CREAT | libc::O_TRUNC, 0o644);
+        if fd == -1 {
+            return Err(std::io::Error::last_os_error().to_string())
+        }
+
+        let shared = |addr: *mut u8, length: usize, offset: usize, flags: libc::c_int| libc::mmap(
+            addr as *mut libc::c_void,
+            length,
+            libc::PROT_READ | libc::PROT_WRITE,
+            libc::MAP_SHARED | flags,
+            fd,
+            offset as libc::off_t
+        );
+
+        let mapped = if libc::ftruncate(fd, (header + size) as libc::off_t) == -1 {
+            Err(std::io::Error::last_os_error().to_string())
+        } else {
+            let head = shared(std::ptr::null_mut(), header, 0, 0);
+
+            if head == libc::MAP_FAILED {
+                Err(std::io::Error::last_os_error().to_string())
+            } else if shared(host, size, header, libc::MAP_FIXED) == libc::MAP_FAILED {
+                let error = std::io::Error::last_os_error().to_string();
+
+                libc::munmap(head, header);
+                Err(error)
+            } else {
+                Ok(std::slice::from_raw_parts_mut(head as *mut u8, header))
+            }
+        };
+
+        libc::close(fd);
+
+        if mapped.is_ok() {
+            copy_in(start as usize, &contents);
+            emu816_mapHost(start, size as u32, host, true);
+            SHM.lock().unwrap().push(name);
+        } else {
+            libc::shm_unlink(name.as_ptr());
+        }
+        mapped
     }
 }
 
-unsafe fn dma_transferb (src: usize, dest: usize, size: usize) {
-    let src_buf = {
-        let mut src_buf = Vec::with_capacity(size);
-        let buffer = BUFFER.read().unwrap();
-        src_buf.set_len(size);
-        src_buf.as_mut_slice().copy_from_slice(&buffer[src..src + size]);
-        src_buf
-    };
+/// Removes the shared memory objects mapped by `map_shm`. Processes that
+/// have them mapped keep them until they unmap them.
+pub fn unlink_shm() {
+    for name in SHM.lock().unwrap().drain(..) {
+        unsafe { libc::shm_unlink(name.as_ptr()) };
+    }
+}
+
+/// Writes back the non-volatile banks, waiting for the writes. The banks are
+/// copied out so the lock is not held across I/O.
+fn write_nvram() {
+    let ranges: Vec<(usize, usize)> = NVRAM.lock().unwrap().iter().map(|nvram| (nvram.base, nvram.size)).collect();
 
-    let mut buffer = BUFFER.write().unwrap();
-    buffer[dest..dest + size].copy_from_slice(src_buf.as_slice());
+    for (base, size) in ranges {
+        unsafe {
+            libc::msync(base as *mut libc::c_void, size, libc::MS_SYNC);
+        }
+    }
 }
 
-pub fn dma_transferb_vr(src: u32, dest: u32, size: u32) {
-    unsafe {
-        let real_src = real_addr!(src);
-        let real_dest = dest as usize;
-        let real_size = size as usize;
+/// Queues a write back of the non-volatile banks and returns at once.
+///
+/// The kernel tracks which pages of the shared mappings are dirty, so only
+/// those are written. The writes are made by a flusher thread and requests
+/// queued while it is busy are merged, so this never blocks the caller on
+/// I/O. Called when the CPU stops and when it reaches the boot-complete
+/// marker, the checkpoint fork-server tests start from. The fuzz harness's
+/// snapshots run without the host, so have no non-volatile banks.
+pub fn sync_nvram() {
+    if NVRAM.lock().unwrap().is_empty() {
+        return
+    }
+
+    let flusher = FLUSHER.get_or_init(|| {
+        let (sender, receiver) = mpsc::channel::<()>();
+
+        std::thread::spawn(move || {
+            while receiver.recv().is_ok() {
+                while receiver.try_recv().is_ok() {}
+                write_nvram();
+            }
+        });
+        Mutex::new(sender)
+    });
+
+    let _ = flusher.lock().unwrap().send(());
+}
+
+/// Makes the non-volatile banks volatile in this process, keeping their
+/// contents. Each bank is mapped again private from its file, so pages are
+/// copied on write and the file is left as it is. Called in a forked child
+/// whose writes must not reach the parent or the next child.
+pub fn detach_nvram() -> Result<(), String> {
+    use std::os::unix::io::AsRawFd;
 
-        println!("DMA TRANSFER B VR: VSRC {{{:X}}} RSRC {{{:X}}} DEST {{{:X}}} SIZE {{{:X}}}", src, real_src, real_dest, real_size);
+    for nvram in NVRAM.lock().unwrap().drain(..) {
+        let mapped = unsafe {
+            libc::mmap(
+                nvram.base as *mut libc::c_void,
+                nvram.size,
+                libc::PROT_READ | libc::PROT_WRITE,
+                libc::MAP_PRIVATE | libc::MAP_FIXED,
+                nvram.file.as_raw_fd(),
+                0
+            )
+        };
 
-        dma_transferb(real_src, real_dest, real_size);
+        if mapped == libc::MAP_FAILED {
+            return Err(std::io::Error::last_os_error().to_string())
+        }
     }
+    Ok(())
 }
 
-pub fn dma_transferb_v(src: u32, dest: u32, size: u32) {
-    unsafe {
-        let real_src = real_addr!(src);
-        let real_dest = real_addr!(dest);
-        let real_size = size as usize;
+/// Writes back the non-volatile banks before the process exits, which would
+/// drop a write queued with `sync_nvram`. Blocks on I/O, so it is called on
+/// the main thread at shutdown only.
+pub fn close_nvram() {
+    write_nvram();
+}
 
-        println!("DMA TRANSFER B V: VSRC {{{:X}}} RSRC {{{:X}}} VDEST {{{:X}}} RDEST {{{:X}}} SIZE {{{:X}}}", src, real_src, dest, real_dest, real_size);
+/// Reads a byte at a real address. Addresses past the end of real memory
+/// read as zero.
+pub fn readb(addr: u32) -> u8 {
+    if addr >= MEMORY_SIZE {
+        return 0
+    }
+    unsafe { host(addr as usize, 1).read() }
+}
 
-        dma_transferb(real_src, real_dest, real_size);
+/// Writes a byte at a real address. Writes past the end of real memory are
+/// ignored.
+pub fn writeb(addr: u32, byte: u8) {
+    if addr < MEMORY_SIZE {
+        unsafe { host(addr as usize, 1).write(byte) };
     }
 }
 
-pub fn dma_transferb_r(src: u32, dest: u32, size: u32) {
+pub fn dma_moveb_out_v(dest: &mut [u8], start: u32, size: usize) {
     unsafe {
-        let real_src = src as usize;
-        let real_dest = dest as usize;
-        let real_size = size as usize;
+        let real_addr = real_addr!(start);
+        copy_out(real_addr, &mut dest[..size]);
+    }
+}
 
-        println!("DMA TRANSFER B R: SRC {{{:X}}} DEST {{{:X}}} SIZE {{{:X}}}", real_src, real_dest, real_size);
+pub fn dma_moveb_out_r(dest: &mut [u8], start: u32, size: usize) {
+    copy_out(start as usize, &mut dest[..size]);
+}
 
-        dma_transferb(real_src, real_dest, real_size);
+pub fn dma_moveb_in(src: &[u8], start: u32) {
+    unsafe {
+        let real_addr = real_addr!(start);
+        copy_in(real_addr, src);
     }
 }
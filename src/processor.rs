@@ -1,70 +1,273 @@
 mod sys;
 
-use sys::{reset, step, is_stopped, StopReason, CoprocessorOpcode, get_stop_reason, resume, interrupt, get_coprocessor_inst};
+use sys::{reset, run, is_stopped, set_marker, CoprocessorOpcode, CoprocessorInst, get_stop_reason, resume, interrupt, get_coprocessor_inst, set_sampling, take_samples, set_perf_counters, get_perf_counters, PerfCounters, set_coverage, get_coverage};
 
-use crate::memory;
+pub use sys::{get_cycles, get_metrics, render_ppu, Metrics, StopReason};
 
-macro_rules! le_u16_as_u32 {
-    ($lsb:expr, $msb:expr) => {
-        (($msb as u32) << 16) + $lsb as u32
-    };
+use std::collections::HashMap;
+use std::fs::File;
+use std::io::{self, BufWriter, Write};
+use std::time::{Duration, Instant};
+use crate::{capture, display, headless, memory};
+
+/// Number of samples the profiler ring buffer can hold between drains.
+const SAMPLE_CAPACITY: u32 = 4096;
+
+/// Processor thread settings.
+#[derive(Clone, Default)]
+pub struct Options {
+    /// If true, emulator traces debug information to console.
+    pub trace: bool,
+    /// If non-zero, the cycle-sampling profiler takes a sample every
+    /// `sample_period` guest cycles and a per-function report is printed when
+    /// the CPU stops.
+    pub sample_period: u32,
+    /// If true, batched execution is measured with host performance counters
+    /// and a report is printed when the CPU stops.
+    pub perf_counters: bool,
+    /// If set, instruction and branch coverage is recorded and written to
+    /// this path when the CPU stops.
+    pub coverage: Option<String>
 }
 
-pub fn processor_func(trace: bool) {
-    reset(trace);
+/// Coprocessor round-trip statistics, measured from the CPU halting on a COP
+/// instruction to the host resuming it.
+#[derive(Clone, Copy, Default)]
+pub struct Stats {
+    pub cop_requests: u64,
+    pub cop_latency: Duration,
+    pub cop_latency_max: Duration
+}
 
-    loop {
-        while !is_stopped() {
-            step();
+/// The CPU and the host side of its coprocessor requests.
+pub struct Processor {
+    options: Options,
+    profile: HashMap<u32, u64>,
+    stats: Stats,
+    stopped: bool,
+    marked: bool
+}
+
+impl Processor {
+    /// Resets the CPU and enables the instrumentation selected by `options`.
+    pub fn new(options: Options) -> Self {
+        reset(options.trace);
+        set_sampling(options.sample_period, SAMPLE_CAPACITY);
+
+        if options.perf_counters && !set_perf_counters(true) {
+            println!("PERF: HOST COUNTERS UNAVAILABLE");
         }
 
-        match get_stop_reason() {
-            Some(StopReason::Coprocessor) => {
-                if let Some(inst) = get_coprocessor_inst() {
-                    match inst.opcode {
-                        CoprocessorOpcode::MmuMapBanks => { // MMU MAP BANKS
-                            for arg in inst.args.chunks_exact(2) {
-                                memory::map_bank(arg[0] as u8, arg[1]);
-                            }
-                        },
-                        CoprocessorOpcode::MmuDmaTransferBVR => { // MMU DMA TRANSFERB VR
-                            assert_eq!(inst.args.len(), 6);
-
-                            let src  = le_u16_as_u32!(inst.args[0], inst.args[1]);
-                            let dest = ((inst.args[3] as u32) << 16) + inst.args[2] as u32;
-                            let size = ((inst.args[5] as u32) << 16) + inst.args[4] as u32;
-
-                            memory::dma_transferb_vr(src, dest, size);
-                        },
-                        CoprocessorOpcode::MmuDmaTransferBV => { // MMU DMA TRANSFERB V
-                            assert_eq!(inst.args.len(), 6);
-
-                            let src  = ((inst.args[1] as u32) << 16) + inst.args[0] as u32;
-                            let dest = ((inst.args[3] as u32) << 16) + inst.args[2] as u32;
-                            let size = ((inst.args[5] as u32) << 16) + inst.args[4] as u32;
-
-                            memory::dma_transferb_v(src, dest, size);
-                        },
-                        CoprocessorOpcode::MmuDmaTransferBR => { // MMU DMA TRANSFERB R
-                            assert_eq!(inst.args.len(), 6);
-
-                            let src  = ((inst.args[1] as u32) << 16) + inst.args[0] as u32;
-                            let dest = ((inst.args[3] as u32) << 16) + inst.args[2] as u32;
-                            let size = ((inst.args[5] as u32) << 16) + inst.args[4] as u32;
-
-                            memory::dma_transferb_r(src, dest, size);
-                        }
+        set_coverage(options.coverage.is_some());
+
+        match memory::bind_to_current_node() {
+            Some(node) => println!("MEMORY: BACKING {{{}}} NODE {{{}}}", format!("{:?}", memory::backing()).to_uppercase(), node),
+            None => println!("MEMORY: BACKING {{{}}}", format!("{:?}", memory::backing()).to_uppercase())
+        }
+
+        Processor {
+            options,
+            profile: HashMap::new(),
+            stats: Stats::default(),
+            stopped: false,
+            marked: false
+        }
+    }
+
+    /// Runs until the CPU cycle counter reaches `cycles`, the CPU executes
+    /// STP or it reaches an armed marker, serving coprocessor requests and
+    /// interrupt waits on the way.
+    ///
+    /// Returns false once the CPU has executed STP.
+    pub fn run_until(&mut self, cycles: u64) -> bool {
+        while !self.stopped {
+            while !is_stopped() {
+                if get_cycles() >= cycles {
+                    return true;
+                }
+
+                // A run ends before it can take more samples than the ring holds
+                let limit = match self.options.sample_period {
+                    0 => cycles,
+                    period => cycles.min(get_cycles() + period as u64 * SAMPLE_CAPACITY as u64)
+                };
+
+                run(u32::MAX, limit);
+                self.drain_samples();
+            }
+
+            let halted = Instant::now();
+
+            match get_stop_reason() {
+                Some(StopReason::Coprocessor) => {
+                    if let Some(inst) = get_coprocessor_inst() {
+                        coprocessor(inst);
                     }
+
+                    let latency = halted.elapsed();
+                    self.stats.cop_requests += 1;
+                    self.stats.cop_latency += latency;
+                    self.stats.cop_latency_max = self.stats.cop_latency_max.max(latency);
+                },
+                Some(StopReason::WaitInterrupt) => {
+                    interrupt();
+                },
+                Some(StopReason::Marker) => {
+                    // The marker is the checkpoint tests start from
+                    memory::sync_nvram();
+                    self.marked = true;
+                    resume();
+                    return true;
+                },
+                Some(StopReason::Stop) | None => {
+                    self.stopped = true;
+                    break;
                 }
-            },
-            Some(StopReason::WaitInterrupt) => {
-                interrupt();
-            },
-            Some(StopReason::Stop) | None => break,
+            }
+
+            resume();
         }
 
-        resume();
+        false
+    }
+
+    /// Adds the samples taken since the last call to the profile, before the
+    /// fixed-size ring wraps. Called after every run of the CPU.
+    fn drain_samples(&mut self) {
+        if self.options.sample_period != 0 {
+            for sample in take_samples() {
+                *self.profile.entry(sample.func).or_insert(0) += 1;
+            }
+        }
+    }
+
+    /// Arms the one-shot marker, see `set_marker`.
+    pub fn set_marker(&mut self, signature: Option<u8>, pc: Option<u32>) {
+        self.marked = false;
+        set_marker(signature, pc);
+    }
+
+    /// True once `run_until` has returned early because the CPU reached the
+    /// marker.
+    pub fn marked(&self) -> bool {
+        self.marked
+    }
+
+    /// Coprocessor statistics so far.
+    pub fn stats(&self) -> Stats {
+        self.stats
+    }
+
+    /// Prints the reports and writes the files selected by the options.
+    pub fn finish(self) {
+        memory::sync_nvram();
+        capture::finish();
+
+        if self.options.sample_period != 0 {
+            print_profile(&self.profile);
+        }
+
+        if self.options.perf_counters {
+            print_perf_counters(&get_perf_counters());
+            set_perf_counters(false);
+        }
+
+        if let Some(path) = &self.options.coverage {
+            if let Err(error) = write_coverage(path) {
+                println!("COVERAGE: CANNOT WRITE {{{}}}: {}", path, error);
+            }
+            set_coverage(false);
+        }
+    }
+}
+
+/// Runs the CPU until it executes STP, handing the framebuffer to the
+/// presenter after each frame's worth of cycles.
+pub fn processor_func(options: Options) {
+    let mut processor = Processor::new(options);
+
+    loop {
+        let running = processor.run_until(get_cycles() + headless::DEFAULT_FRAME_CYCLES);
+
+        display::end_slice();
+        if !running {
+            break
+        }
     }
 
     println!("Stop!");
+
+    processor.finish();
+}
+
+fn coprocessor(inst: CoprocessorInst) {
+    match inst.opcode {
+        CoprocessorOpcode::MmuMapBanks |
+        CoprocessorOpcode::MmuMapPages |
+        CoprocessorOpcode::MmuDmaTransferBVR |
+        CoprocessorOpcode::MmuDmaTransferBV |
+        CoprocessorOpcode::MmuDmaTransferBR |
+        CoprocessorOpcode::DmaBlit |
+        CoprocessorOpcode::DmaFill |
+        CoprocessorOpcode::DmaConvert => {
+            unreachable!("mapping and transfers are served by the core")
+        },
+        CoprocessorOpcode::FramePresent => { // FRAME PRESENT
+            display::present();
+        }
+    }
+}
+
+/// Writes one line per covered address as `BBAAAA FLAGS`, sorted by address,
+/// so entries can be matched against the ld65 map and listing files.
+fn write_coverage(path: &str) -> io::Result<()> {
+    let mut file = BufWriter::new(File::create(path)?);
+
+    writeln!(file, "# yardland coverage v1")?;
+    writeln!(file, "# address flags (X executed, T branch taken, N branch not taken)")?;
+
+    for bank in 0..=u8::MAX {
+        if let Some(coverage) = get_coverage(bank) {
+            for addr in 0..=u16::MAX {
+                let (executed, taken, not_taken) = coverage.at(addr);
+
+                if executed {
+                    writeln!(file, "{:02X}{:04X} X{}{}", bank, addr,
+                        if taken { "T" } else { "" },
+                        if not_taken { "N" } else { "" })?;
+                }
+            }
+        }
+    }
+
+    file.flush()
+}
+
+fn print_perf_counters(counters: &PerfCounters) {
+    let guest = counters.guest_instructions.max(1) as f64;
+    let seconds = counters.nanoseconds.max(1) as f64 / 1e9;
+
+    println!("PERF: CYCLES {{{}}} INSTRUCTIONS {{{}}}", get_cycles(), counters.guest_instructions);
+    println!("PERF: GUEST MIPS {{{:.2}}} EMULATED MHZ {{{:.2}}}",
+        counters.guest_instructions as f64 / seconds / 1e6,
+        counters.guest_cycles as f64 / seconds / 1e6);
+
+    if counters.host_instructions != 0 {
+        println!("PERF: PER GUEST INSTRUCTION HOST CYCLES {{{:.2}}} HOST INSTRUCTIONS {{{:.2}}} BRANCH MISSES {{{:.4}}} CACHE MISSES {{{:.4}}}",
+            counters.host_cycles as f64 / guest,
+            counters.host_instructions as f64 / guest,
+            counters.branch_misses as f64 / guest,
+            counters.cache_misses as f64 / guest);
+    }
+}
+
+fn print_profile(profile: &HashMap<u32, u64>) {
+    let total: u64 = profile.values().sum();
+    let mut funcs: Vec<(&u32, &u64)> = profile.iter().collect();
+    funcs.sort_by(|a, b| b.1.cmp(a.1));
+
+    println!("PROFILE: {} SAMPLES", total);
+    for (func, count) in funcs.iter().take(32) {
+        println!("{:06X} {:>10} {:>6.2}%", func, count, **count as f64 * 100.0 / total as f64);
+    }
 }
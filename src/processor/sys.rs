@@ -8,16 +8,27 @@ use num_enum::TryFromPrimitive;
 extern "C" {
     fn emu816_reset(trace: bool);
     fn emu816_step();
-    fn emu816_getCycles() -> u32;
+    fn emu816_run(count: u32, limit: u64) -> u32;
+    fn emu816_getCycles() -> u64;
     fn emu816_isStopped() -> bool;
     fn emu816_resume();
     fn emu816_getStopReason() -> isize;
     fn emu816_interrupt();
     fn emu816_getCopInstSize() -> u8;
     fn emu816_getCopInst(inst: *mut u16) -> u8;
+    fn emu816_setSampling(period: u32, capacity: u32);
+    fn emu816_getSamples(dest: *mut Sample, count: u32) -> u32;
+    fn emu816_setPerfCounters(enable: bool) -> bool;
+    fn emu816_getPerfCounters(dest: *mut PerfCounters);
+    fn emu816_getMetrics(dest: *mut Metrics);
+    fn emu816_setCoverage(enable: bool);
+    fn emu816_setMarker(signature: i32, pc: u32);
+    fn emu816_getCoverage(bank: u8) -> *const Coverage;
+    fn emu816_renderPpu() -> bool;
 }
 
-// Memory access functions
+// Memory access functions, called by the core for unmapped pages with real
+// addresses
 
 #[no_mangle]
 pub extern "C" fn readb(addr: u32) -> u8 {
@@ -38,7 +49,8 @@ pub extern "C" fn writeb(addr: u32, byte: u8) {
 pub enum StopReason {
     Coprocessor = 1,
     WaitInterrupt,
-    Stop
+    Stop,
+    Marker
 }
 
 #[derive(TryFromPrimitive)]
@@ -48,6 +60,11 @@ pub enum CoprocessorOpcode {
     MmuDmaTransferBVR,
     MmuDmaTransferBV,
     MmuDmaTransferBR,
+    MmuMapPages,
+    DmaBlit,
+    DmaFill,
+    DmaConvert,
+    FramePresent,
 }
 
 pub struct CoprocessorInst {
@@ -55,6 +72,20 @@ pub struct CoprocessorInst {
     pub args: Vec<u16>
 }
 
+/// A profiler sample taken by the cycle-sampling profiler.
+#[repr(C)]
+#[derive(Clone, Copy, Default)]
+pub struct Sample {
+    /// Full 24-bit `PBR:PC` of the next instruction.
+    pub pc: u32,
+    /// Entry point at the top of the shadow call stack.
+    pub func: u32,
+    /// Status register, holds the M and X flags.
+    pub p: u8,
+    /// Emulation flag.
+    pub e: u8
+}
+
 /// Resets the CPU.
 /// 
 /// `trace`: If true, emulator traces debug information to console.
@@ -71,13 +102,31 @@ pub fn step() {
     }
 }
 
+/// Executes up to `count` instructions, returning early if the CPU halts or
+/// the cycle counter reaches `limit`.
+///
+/// Returns the number of instructions executed.
+pub fn run(count: u32, limit: u64) -> u32 {
+    unsafe {
+        emu816_run(count, limit)
+    }
+}
+
 /// Get cycles.
-pub fn get_cycles() -> u32 {
+pub fn get_cycles() -> u64 {
     unsafe {
         emu816_getCycles()
     }
 }
 
+/// Composites the tile and sprite device into its output if it is enabled,
+/// and returns true if it was.
+pub fn render_ppu() -> bool {
+    unsafe {
+        emu816_renderPpu()
+    }
+}
+
 /// Returns true if the CPU has halted execution.
 pub fn is_stopped() -> bool {
     unsafe {
@@ -123,3 +172,158 @@ pub fn get_coprocessor_inst() -> Option<CoprocessorInst> {
         )
     }
 }
+
+/// Host hardware counters and guest totals accumulated over `run` calls.
+#[repr(C)]
+#[derive(Clone, Copy, Default)]
+pub struct PerfCounters {
+    pub host_cycles: u64,
+    pub host_instructions: u64,
+    pub branch_misses: u64,
+    pub cache_misses: u64,
+    pub guest_instructions: u64,
+    pub guest_cycles: u64,
+    pub nanoseconds: u64
+}
+
+/// Enables measurement of `run` calls.
+///
+/// Must be called from the thread that calls `run`. Returns false if the
+/// host hardware counters are unavailable, in which case only the guest and
+/// wall clock totals are kept.
+pub fn set_perf_counters(enable: bool) -> bool {
+    unsafe {
+        emu816_setPerfCounters(enable)
+    }
+}
+
+/// Returns the totals measured since `set_perf_counters` was enabled.
+pub fn get_perf_counters() -> PerfCounters {
+    unsafe {
+        let mut counters = PerfCounters::default();
+        emu816_getPerfCounters(&mut counters);
+        counters
+    }
+}
+
+/// Runtime metrics for the emulated CPU.
+#[repr(C)]
+#[derive(Clone, Copy)]
+pub struct Metrics {
+    /// Instructions retired.
+    pub instructions: u64,
+    /// Guest cycles at the last retired instruction.
+    pub cycles: u64,
+    /// Halts, indexed by `StopReason`.
+    pub stops: [u64; 5],
+    /// Coprocessor requests, indexed by `CoprocessorOpcode`.
+    pub cop_requests: [u64; 256],
+    /// Interrupts taken.
+    pub interrupts: u64,
+    /// Host time spent executing instructions.
+    pub running_ns: u64,
+    /// Host time spent halted, waiting for the host to resume the CPU.
+    pub stopped_ns: u64,
+    /// Byte reads made through the memory callbacks.
+    pub memory_reads: u64,
+    /// Byte writes made through the memory callbacks.
+    pub memory_writes: u64
+}
+
+impl Metrics {
+    /// Halts for the given reason.
+    pub fn stops_for(&self, reason: StopReason) -> u64 {
+        self.stops[reason as usize]
+    }
+}
+
+/// Takes a snapshot of the runtime metrics.
+///
+/// Safe to call from any thread while the CPU is running.
+pub fn get_metrics() -> Metrics {
+    unsafe {
+        let mut metrics = std::mem::MaybeUninit::<Metrics>::uninit();
+        emu816_getMetrics(metrics.as_mut_ptr());
+        metrics.assume_init()
+    }
+}
+
+/// Coverage of one bank, a nibble of flags per address, even addresses in
+/// the low nibble.
+#[repr(C)]
+#[derive(Clone)]
+pub struct Coverage {
+    pub flags: [u8; 32768]
+}
+
+impl Coverage {
+    /// An instruction was fetched at the address.
+    const EXECUTED: u8 = 1;
+    /// The relative branch at the address was taken.
+    const TAKEN: u8 = 2;
+    /// The relative branch at the address fell through.
+    const NOT_TAKEN: u8 = 4;
+
+    /// Returns the (executed, taken, not taken) bits for an address in the bank.
+    pub fn at(&self, addr: u16) -> (bool, bool, bool) {
+        let flags = self.flags[(addr >> 1) as usize] >> ((addr & 1) * 4);
+
+        (
+            flags & Self::EXECUTED != 0,
+            flags & Self::TAKEN != 0,
+            flags & Self::NOT_TAKEN != 0
+        )
+    }
+}
+
+/// Starts recording coverage with cleared flags, or stops and discards them.
+pub fn set_coverage(enable: bool) {
+    unsafe {
+        emu816_setCoverage(enable);
+    }
+}
+
+/// Copies the coverage flags of a bank.
+///
+/// Returns None if no instruction has executed in the bank.
+pub fn get_coverage(bank: u8) -> Option<Box<Coverage>> {
+    unsafe {
+        emu816_getCoverage(bank).as_ref().map(|coverage| Box::new(coverage.clone()))
+    }
+}
+
+/// Arms a one-shot marker: the CPU halts with `StopReason::Marker` after a
+/// `WDM` with the given signature byte or before the instruction at the given
+/// `PBR:PC`, whichever comes first. `None` for both disarms it.
+pub fn set_marker(signature: Option<u8>, pc: Option<u32>) {
+    unsafe {
+        emu816_setMarker(signature.map_or(-1, i32::from), pc.unwrap_or(u32::MAX));
+    }
+}
+
+/// Enables the cycle-sampling profiler.
+///
+/// `period`: Guest cycles between samples, 0 disables sampling.
+/// `capacity`: Size of the preallocated sample ring.
+pub fn set_sampling(period: u32, capacity: u32) {
+    unsafe {
+        emu816_setSampling(period, capacity);
+    }
+}
+
+/// Drains the samples recorded since the last call, oldest first.
+pub fn take_samples() -> Vec<Sample> {
+    unsafe {
+        let mut samples = vec![Sample::default(); 1024];
+        let mut taken = Vec::new();
+
+        loop {
+            let count = emu816_getSamples(samples.as_mut_ptr(), samples.len() as u32) as usize;
+            taken.extend_from_slice(&samples[..count]);
+
+            if count < samples.len() {
+                break taken
+            }
+        }
+    }
+}
@@ -0,0 +1,236 @@
+// Microbenchmarks for the emu816 interpreter core.
+//
+// Each case builds a small guest program in a flat in-memory address space:
+// a setup prologue that selects the register widths and flags, then a body
+// instruction repeated many times and closed by a JMP back to the start of
+// the body. The CPU is run for a fixed number of instructions several times
+// and the time per instruction is reported as min/median/mean/stddev.
+
+#include "emu816.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+static uint8_t memory[1 << 24];
+
+extern "C" {
+    uint8_t readb(uint32_t addr) {
+        return memory[addr & 0xFFFFFF];
+    }
+
+    void writeb(uint32_t addr, uint8_t byte) {
+        memory[addr & 0xFFFFFF] = byte;
+    }
+}
+
+typedef std::vector<uint8_t> Bytes;
+
+// Where the program is placed in bank 0
+static const uint32_t SETUP = 0x8000;
+static const uint32_t SUBROUTINE = 0x7000;
+static const uint32_t HANDLER = 0x7100;
+static const uint32_t DATA = 0x4000;
+
+// Prologues. Emulation mode starts with M=X=1, so the index registers are
+// loaded with 8-bit immediates before switching to native mode.
+static const Bytes INDEX = { 0xA2, 0x04, 0xA0, 0x04 };          // LDX #4, LDY #4
+static const Bytes NATIVE = { 0x18, 0xFB };                     // CLC, XCE
+static const Bytes M8X8 = { 0xE2, 0x30 };                       // SEP #$30
+static const Bytes M16X16 = { 0xC2, 0x30 };                     // REP #$30
+static const Bytes DECIMAL = { 0xF8 };                          // SED
+static const Bytes NONZERO = { 0xA9, 0x01 };                    // LDA #1 (M=1)
+static const Bytes IRQS = { 0x58 };                             // CLI
+
+static uint8_t lo16(uint32_t value) {
+    return value & 0xFF;
+}
+
+static uint8_t hi16(uint32_t value) {
+    return (value >> 8) & 0xFF;
+}
+
+struct Case {
+    const char *name;
+    Bytes setup;
+    Bytes body;
+    unsigned int copies;
+    bool irq;
+};
+
+static Bytes concat(std::initializer_list<Bytes> parts) {
+    Bytes all;
+
+    for (const Bytes &part : parts)
+        all.insert(all.end(), part.begin(), part.end());
+    return all;
+}
+
+static Case byte8(const char *name, Bytes body) {
+    return { name, concat({ INDEX, NATIVE, M8X8 }), body, 1000, false };
+}
+
+static Case word16(const char *name, Bytes body) {
+    return { name, concat({ INDEX, NATIVE, M16X16 }), body, 1000, false };
+}
+
+static std::vector<Case> cases() {
+    return {
+        byte8("nop", { 0xEA }),
+        byte8("inx", { 0xE8 }),
+
+        byte8("lda #imm      m8", { 0xA9, 0x12 }),
+        byte8("lda dp        m8", { 0xA5, 0x10 }),
+        byte8("lda dp,x      m8", { 0xB5, 0x10 }),
+        byte8("lda abs       m8", { 0xAD, 0x00, 0x40 }),
+        byte8("lda abs,x     m8", { 0xBD, 0x00, 0x40 }),
+        byte8("lda abs,y     m8", { 0xB9, 0x00, 0x40 }),
+        byte8("lda long      m8", { 0xAF, 0x00, 0x40, 0x00 }),
+        byte8("lda long,x    m8", { 0xBF, 0x00, 0x40, 0x00 }),
+        byte8("lda (dp)      m8", { 0xB2, 0x10 }),
+        byte8("lda (dp,x)    m8", { 0xA1, 0x0C }),
+        byte8("lda (dp),y    m8", { 0xB1, 0x10 }),
+        byte8("lda [dp]      m8", { 0xA7, 0x20 }),
+        byte8("lda [dp],y    m8", { 0xB7, 0x20 }),
+        byte8("lda sr,s      m8", { 0xA3, 0x01 }),
+        byte8("lda (sr,s),y  m8", { 0xB3, 0x01 }),
+        byte8("sta abs       m8", { 0x8D, 0x00, 0x40 }),
+        byte8("inc abs       m8", { 0xEE, 0x00, 0x40 }),
+
+        word16("lda #imm      m16", { 0xA9, 0x34, 0x12 }),
+        word16("lda abs       m16", { 0xAD, 0x00, 0x40 }),
+        word16("lda long,x    m16", { 0xBF, 0x00, 0x40, 0x00 }),
+        word16("sta abs       m16", { 0x8D, 0x00, 0x40 }),
+        word16("inc abs       m16", { 0xEE, 0x00, 0x40 }),
+        byte8("ldx #imm      x8", { 0xA2, 0x04 }),
+        word16("ldx #imm      x16", { 0xA2, 0x04, 0x00 }),
+
+        byte8("adc #imm      m8", { 0x69, 0x01 }),
+        word16("adc #imm      m16", { 0x69, 0x01, 0x00 }),
+        { "adc #imm  dec m8", concat({ INDEX, NATIVE, M8X8, DECIMAL }), { 0x69, 0x01 }, 1000, false },
+        { "adc #imm  dec m16", concat({ INDEX, NATIVE, M16X16, DECIMAL }), { 0x69, 0x01, 0x00 }, 1000, false },
+        { "sbc #imm  dec m8", concat({ INDEX, NATIVE, M8X8, DECIMAL }), { 0xE9, 0x01 }, 1000, false },
+        { "sbc #imm  dec m16", concat({ INDEX, NATIVE, M16X16, DECIMAL }), { 0xE9, 0x01, 0x00 }, 1000, false },
+
+        byte8("bra taken", { 0x80, 0x00 }),
+        { "bne taken", concat({ INDEX, NATIVE, M8X8, NONZERO }), { 0xD0, 0x00 }, 1000, false },
+        { "beq not taken", concat({ INDEX, NATIVE, M8X8, NONZERO }), { 0xF0, 0x00 }, 1000, false },
+        byte8("jsr+rts", { 0x20, lo16(SUBROUTINE), hi16(SUBROUTINE) }),
+        byte8("pha+pla", { 0x48, 0x68 }),
+
+        // LDA #$0FFF, LDX #src, LDY #dst, MVN/MVP 0,0 moves 4 KiB per pass
+        word16("mvn", { 0xA9, 0xFF, 0x0F, 0xA2, 0x00, 0x40, 0xA0, 0x00, 0x60, 0x54, 0x00, 0x00 }),
+        word16("mvp", { 0xA9, 0xFF, 0x0F, 0xA2, 0xFF, 0x4F, 0xA0, 0xFF, 0x6F, 0x44, 0x00, 0x00 }),
+
+        // Every instruction is preceded by an IRQ whose handler is just RTI
+        { "irq entry+rti", concat({ INDEX, NATIVE, M8X8, IRQS }), { 0xEA }, 1000, true },
+    };
+}
+
+static void load(const Case &c) {
+    std::memset(memory, 0, sizeof(memory));
+
+    uint32_t addr = SETUP;
+
+    for (uint8_t byte : c.setup)
+        memory[addr++] = byte;
+
+    uint32_t body = addr;
+    for (unsigned int i = 0; i < c.copies; i++)
+        for (uint8_t byte : c.body)
+            memory[addr++] = byte;
+
+    memory[addr++] = 0x4C;                                      // JMP body
+    memory[addr++] = lo16(body);
+    memory[addr++] = hi16(body);
+
+    memory[SUBROUTINE] = 0x60;                                  // RTS
+    memory[HANDLER] = 0x40;                                     // RTI
+
+    // Direct page pointers for the indirect modes
+    memory[0x10] = lo16(DATA);
+    memory[0x11] = hi16(DATA);
+    memory[0x20] = lo16(DATA);
+    memory[0x21] = hi16(DATA);
+    memory[0x22] = 0x00;
+
+    // Stack relative indirect pointer
+    memory[0x0102] = lo16(DATA);
+    memory[0x0103] = hi16(DATA);
+
+    memory[0xFFFC] = lo16(SETUP);
+    memory[0xFFFD] = hi16(SETUP);
+    memory[0xFFEE] = lo16(HANDLER);
+    memory[0xFFEF] = hi16(HANDLER);
+    memory[0xFFFE] = lo16(HANDLER);
+    memory[0xFFFF] = hi16(HANDLER);
+}
+
+// Run count instructions and return the time taken in nanoseconds
+static double measure(const Case &c, unsigned long count) {
+    using namespace std::chrono;
+
+    auto start = steady_clock::now();
+
+    if (c.irq) {
+        for (unsigned long i = 0; i < count; i += 2) {
+            emu816::interrupt();
+            emu816::step();
+            emu816::step();
+        }
+    } else {
+        emu816::run(count);
+    }
+
+    return duration<double, std::nano>(steady_clock::now() - start).count();
+}
+
+int main(int argc, char **argv) {
+    unsigned long count = argc > 1 ? std::strtoul(argv[1], NULL, 0) : 2000000;
+    unsigned int repeats = argc > 2 ? std::strtoul(argv[2], NULL, 0) : 9;
+    const char *filter = argc > 3 ? argv[3] : NULL;
+
+    // Map the whole space as RAM so accesses take the direct host path, as in
+    // the emulator, rather than the readb/writeb fallback
+    emu816::loadMap("MEMORY { RAM: start = $0, size = $1000000; }", memory, sizeof(memory));
+
+    std::printf("%-20s %10s %10s %10s %10s\n", "case", "min", "median", "mean", "stddev");
+    std::printf("%-20s %10s %10s %10s %10s\n", "", "ns/inst", "ns/inst", "ns/inst", "ns/inst");
+
+    for (const Case &c : cases()) {
+        if (filter != NULL && std::strstr(c.name, filter) == NULL)
+            continue;
+
+        load(c);
+        emu816::reset(false);
+
+        // Run the prologue and warm up caches and branch predictors
+        emu816::run(c.setup.size() + count / 10);
+
+        std::vector<double> results;
+        for (unsigned int r = 0; r < repeats; r++)
+            results.push_back(measure(c, count) / count);
+
+        std::sort(results.begin(), results.end());
+
+        double mean = 0;
+        for (double result : results)
+            mean += result;
+        mean /= results.size();
+
+        double variance = 0;
+        for (double result : results)
+            variance += (result - mean) * (result - mean);
+        variance /= results.size();
+
+        std::printf("%-20s %10.2f %10.2f %10.2f %10.2f\n", c.name,
+                    results.front(), results[results.size() / 2], mean, std::sqrt(variance));
+    }
+
+    return 0;
+}
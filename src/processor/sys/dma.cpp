@@ -0,0 +1,519 @@
+#include "dma.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <stdint.h>
+#include <thread>
+#include <vector>
+
+static std::thread worker;
+
+// Return the real address of a byte in a range
+unsigned long dma::resolveReal(Addr addr, bool is_virtual, Addr offset) {
+    if (is_virtual)
+        return translate((addr + offset) & 0xffffff);
+    return addr + offset;
+}
+
+// Resolve the longest run of host memory, up to limit bytes, starting at an
+// offset into a range
+dma::Span dma::resolve(Addr addr, bool is_virtual, Addr offset, Addr limit, bool write) {
+    Span span;
+
+    span.real = resolveReal(addr, is_virtual, offset);
+    span.host = NULL;
+    span.length = PAGE_SIZE - (span.real & PAGE_MASK);
+
+    if ((span.real >> PAGE_BITS) < REAL_PAGES) {
+        const Page &page = real[span.real >> PAGE_BITS];
+        Byte *base = write ? page.write : page.read;
+
+        if (base != NULL)
+            span.host = base + (span.real & PAGE_MASK);
+    }
+
+    // Extend across pages that continue the same host memory
+    while (span.host != NULL && span.length < limit) {
+        unsigned long next = resolveReal(addr, is_virtual, offset + span.length);
+
+        if ((next >> PAGE_BITS) >= REAL_PAGES)
+            break;
+
+        const Page &page = real[next >> PAGE_BITS];
+
+        if ((write ? page.write : page.read) != span.host + span.length)
+            break;
+        span.length += PAGE_SIZE;
+    }
+
+    if (span.length > limit)
+        span.length = limit;
+    return span;
+}
+
+// Copy length bytes between two resolved runs
+void dma::move(const Span &dest, const Span &src, Addr length, bool backward) {
+    if (dest.host != NULL) {
+        touch(dest.real, length);
+
+        if (src.host != NULL) {
+            std::memmove(dest.host, src.host, length);
+            return;
+        }
+    }
+
+    if (backward) {
+        for (Addr i = length; i-- > 0; )
+            writeReal(dest.real + i, src.host ? src.host[i] : readReal(src.real + i));
+    }
+    else {
+        for (Addr i = 0; i < length; ++i)
+            writeReal(dest.real + i, src.host ? src.host[i] : readReal(src.real + i));
+    }
+}
+
+// Copy a range to host memory a run at a time, reading pages without host
+// memory a byte at a time
+void dma::copyOut(Addr src, bool src_virtual, Byte *host, Addr size) {
+    for (Addr offset = 0; offset < size; ) {
+        Span s = resolve(src, src_virtual, offset, size - offset, false);
+
+        if (s.host != NULL)
+            std::memcpy(host + offset, s.host, s.length);
+        else
+            for (Addr i = 0; i < s.length; ++i)
+                host[offset + i] = readReal(s.real + i);
+        offset += s.length;
+    }
+}
+
+// Return true if a range is one run of real addresses, as real ranges are
+// and CPU ranges are unless their pages are mapped out of order
+bool dma::isLinear(Addr addr, bool is_virtual, Addr size) {
+    if (!is_virtual)
+        return true;
+
+    unsigned long first = resolveReal(addr, true, 0);
+
+    for (Addr offset = PAGE_SIZE - (first & PAGE_MASK); offset < size; offset += PAGE_SIZE)
+        if (resolveReal(addr, true, offset) != first + offset)
+            return false;
+    return true;
+}
+
+// Return true if two ranges share a real page
+bool dma::sharePage(Addr src, bool src_virtual, Addr dest, bool dest_virtual, Addr size) {
+    std::vector<unsigned long> pages;
+
+    for (Addr offset = 0; offset < size; ) {
+        unsigned long real = resolveReal(src, src_virtual, offset);
+
+        pages.push_back(real >> PAGE_BITS);
+        offset += PAGE_SIZE - (real & PAGE_MASK);
+    }
+    std::sort(pages.begin(), pages.end());
+
+    for (Addr offset = 0; offset < size; ) {
+        unsigned long real = resolveReal(dest, dest_virtual, offset);
+
+        if (std::binary_search(pages.begin(), pages.end(), real >> PAGE_BITS))
+            return true;
+        offset += PAGE_SIZE - (real & PAGE_MASK);
+    }
+    return false;
+}
+
+// Copy size bytes, front to back unless the destination overlaps the end of
+// the source. Ranges whose pages are mapped out of order and share pages go
+// through an intermediate buffer.
+void dma::transfer(Addr src, bool src_virtual, Addr dest, bool dest_virtual, Addr size) {
+    if (size == 0)
+        return;
+
+    bool backward = false;
+
+    if (isLinear(src, src_virtual, size) && isLinear(dest, dest_virtual, size)) {
+        unsigned long src_real = resolveReal(src, src_virtual, 0);
+        unsigned long dest_real = resolveReal(dest, dest_virtual, 0);
+
+        backward = dest_real > src_real && dest_real < src_real + size;
+    }
+    else if (sharePage(src, src_virtual, dest, dest_virtual, size)) {
+        std::vector<Byte> buffer(size);
+
+        copyOut(src, src_virtual, buffer.data(), size);
+
+        for (Addr offset = 0; offset < size; ) {
+            Span d = resolve(dest, dest_virtual, offset, size - offset, true);
+            Span b = { buffer.data() + offset, 0, d.length };
+
+            move(d, b, d.length, false);
+            offset += d.length;
+        }
+        return;
+    }
+
+    if (!backward) {
+        for (Addr offset = 0; offset < size; ) {
+            Span s = resolve(src, src_virtual, offset, size - offset, false);
+            Span d = resolve(dest, dest_virtual, offset, s.length, true);
+            Addr length = d.length < s.length ? d.length : s.length;
+
+            move(d, s, length, false);
+            offset += length;
+        }
+        return;
+    }
+
+    // Back to front, a page at a time
+    for (Addr end = size; end > 0; ) {
+        Addr length = end;
+        Addr in_src = (resolveReal(src, src_virtual, end - 1) & PAGE_MASK) + 1;
+        Addr in_dest = (resolveReal(dest, dest_virtual, end - 1) & PAGE_MASK) + 1;
+
+        if (in_src < length) length = in_src;
+        if (in_dest < length) length = in_dest;
+
+        Span s = resolve(src, src_virtual, end - length, length, false);
+        Span d = resolve(dest, dest_virtual, end - length, length, true);
+
+        move(d, s, length, true);
+        end -= length;
+    }
+}
+
+// Copy the pixels of a row that differ from the key. Written without
+// branches so the compiler turns it into vector compares and blends.
+template <typename T>
+static void keyPixels(uint8_t *dest, const uint8_t *src, unsigned long count, T key) {
+    for (unsigned long i = 0; i < count; ++i) {
+        T s, d;
+
+        std::memcpy(&s, src + i * sizeof(T), sizeof(T));
+        std::memcpy(&d, dest + i * sizeof(T), sizeof(T));
+        d = (s == key) ? d : s;
+        std::memcpy(dest + i * sizeof(T), &d, sizeof(T));
+    }
+}
+
+// Copy one keyed row, in bulk when both ends are in contiguous host memory
+void dma::keyRow(Addr src, bool src_virtual, Addr dest, bool dest_virtual,
+                 Addr length, Byte pixel_size, uint32_t key) {
+    Span s = resolve(src, src_virtual, 0, length, false);
+    Span d = resolve(dest, dest_virtual, 0, length, true);
+
+    if (s.host != NULL && d.host != NULL && s.length == length && d.length == length) {
+        std::vector<Byte> row;
+
+        // A row shifted right over itself is read whole first
+        if (d.host > s.host && d.host < s.host + length) {
+            row.assign(s.host, s.host + length);
+            s.host = row.data();
+        }
+
+        touch(d.real, length);
+
+        switch (pixel_size) {
+        case 1: keyPixels<uint8_t>(d.host, s.host, length, key); return;
+        case 2: keyPixels<uint16_t>(d.host, s.host, length / 2, key); return;
+        case 4: keyPixels<uint32_t>(d.host, s.host, length / 4, key); return;
+        }
+
+        for (Addr i = 0; i + pixel_size <= length; i += pixel_size) {
+            uint32_t pixel = 0;
+
+            std::memcpy(&pixel, s.host + i, pixel_size);
+            if (pixel != key)
+                std::memcpy(d.host + i, s.host + i, pixel_size);
+        }
+        return;
+    }
+
+    // A pixel at a time, through the same paths as the CPU
+    for (Addr i = 0; i + pixel_size <= length; i += pixel_size) {
+        uint32_t pixel = 0;
+
+        for (Byte b = 0; b < pixel_size; ++b)
+            pixel |= (uint32_t) readReal(resolveReal(src, src_virtual, i + b)) << (8 * b);
+
+        if (pixel != key)
+            for (Byte b = 0; b < pixel_size; ++b)
+                writeReal(resolveReal(dest, dest_virtual, i + b), pixel >> (8 * b));
+    }
+}
+
+// Copy a rectangle a row at a time, in the order that reads each source row
+// before it is overwritten
+void dma::blit(Addr src, bool src_virtual, Word src_pitch,
+               Addr dest, bool dest_virtual, Word dest_pitch,
+               Word width, Word height, Byte pixel_size, bool keyed, uint32_t key) {
+    if (pixel_size < 1 || pixel_size > 4)
+        return;
+
+    Addr length = (Addr) width * pixel_size;
+    Addr src_extent = height ? (Addr) (height - 1) * src_pitch + length : 0;
+    Addr dest_extent = height ? (Addr) (height - 1) * dest_pitch + length : 0;
+    bool backward = false;
+
+    if (pixel_size < 4)
+        key &= (1u << (8 * pixel_size)) - 1;
+
+    // Bottom to top when the destination overlaps the source from below
+    if (height > 1 && isLinear(src, src_virtual, src_extent) && isLinear(dest, dest_virtual, dest_extent)) {
+        unsigned long src_real = resolveReal(src, src_virtual, 0);
+        unsigned long dest_real = resolveReal(dest, dest_virtual, 0);
+
+        backward = dest_real > src_real && dest_real < src_real + src_extent;
+    }
+
+    for (Word row = 0; row < height; ++row) {
+        Word y = backward ? height - 1 - row : row;
+        Addr s = src + (Addr) y * src_pitch;
+        Addr d = dest + (Addr) y * dest_pitch;
+
+        if (keyed)
+            keyRow(s, src_virtual, d, dest_virtual, length, pixel_size, key);
+        else
+            transfer(s, src_virtual, d, dest_virtual, length);
+    }
+}
+
+// Fill one line from a block holding the pattern repeated over 128 bytes
+void dma::fillRow(Addr dest, bool dest_virtual, Addr length, const Byte *block, Byte pattern_size) {
+    for (Addr offset = 0; offset < length; ) {
+        Span d = resolve(dest, dest_virtual, offset, length - offset, true);
+        Addr phase = offset % pattern_size;
+
+        if (d.host == NULL) {
+            for (Addr i = 0; i < d.length; ++i)
+                writeReal(d.real + i, block[(phase + i) % pattern_size]);
+            offset += d.length;
+            continue;
+        }
+
+        touch(d.real, d.length);
+
+        // Seed up to 64 bytes, then double the filled part, which stays a
+        // whole number of patterns
+        Addr done = d.length < 64 ? d.length : 64;
+
+        std::memcpy(d.host, block + phase, done);
+        while (done < d.length) {
+            Addr next = d.length - done < done ? d.length - done : done;
+
+            std::memcpy(d.host + done, d.host, next);
+            done += next;
+        }
+        offset += d.length;
+    }
+}
+
+// Fill a range or a rectangle with a pattern
+dma::Addr dma::fill(Addr dest, bool dest_virtual, Addr count, Word lines, Word pitch,
+                    Byte pattern_size, uint32_t pattern) {
+    if (pattern_size != 1 && pattern_size != 2 && pattern_size != 4)
+        return 0;
+
+    // Line lengths are 32-bit
+    if (count > 0xffffffffUL / pattern_size)
+        return 0;
+
+    Byte block[128];
+    Addr length = count * pattern_size;
+
+    for (int i = 0; i < 128; ++i)
+        block[i] = pattern >> (8 * (i % pattern_size));
+
+    for (Word y = 0; y < lines; ++y)
+        fillRow(dest + (Addr) y * pitch, dest_virtual, length, block, pattern_size);
+
+    return length * lines;
+}
+
+static const uint8_t PIXEL_SIZE[PIXEL_FORMATS] = {3, 3, 2, 1};
+
+// Return the bytes per pixel of a format
+dma::Byte dma::pixelSize(Byte format) {
+    return format < PIXEL_FORMATS ? PIXEL_SIZE[format] : 0;
+}
+
+// Unpack a pixel into blue, green and red
+template <int Format>
+static inline void unpackPixel(const uint8_t *src, const uint8_t *palette, uint8_t &b, uint8_t &g, uint8_t &r) {
+    if (Format == PIXEL_BGR888) {
+        b = src[0]; g = src[1]; r = src[2];
+    }
+    else if (Format == PIXEL_RGB888) {
+        r = src[0]; g = src[1]; b = src[2];
+    }
+    else if (Format == PIXEL_RGB565) {
+        uint16_t p = src[0] | src[1] << 8;
+
+        r = (p >> 11) << 3 | p >> 13;
+        g = ((p >> 5) & 0x3f) << 2 | ((p >> 9) & 0x03);
+        b = (p & 0x1f) << 3 | ((p >> 2) & 0x07);
+    }
+    else {
+        const uint8_t *entry = palette + 3 * src[0];
+
+        b = entry[0]; g = entry[1]; r = entry[2];
+    }
+}
+
+// Pack blue, green and red into a pixel
+template <int Format>
+static inline void packPixel(uint8_t *dest, uint8_t b, uint8_t g, uint8_t r) {
+    if (Format == PIXEL_BGR888) {
+        dest[0] = b; dest[1] = g; dest[2] = r;
+    }
+    else if (Format == PIXEL_RGB888) {
+        dest[0] = r; dest[1] = g; dest[2] = b;
+    }
+    else {
+        uint16_t p = (r >> 3) << 11 | (g >> 2) << 5 | b >> 3;
+
+        dest[0] = p; dest[1] = p >> 8;
+    }
+}
+
+// Convert count pixels. Each instance is a straight loop over fixed-size
+// pixels, which the compiler vectorizes except for palette lookups.
+template <int From, int To>
+static void convertPixels(uint8_t *dest, const uint8_t *src, unsigned long count, const uint8_t *palette) {
+    for (unsigned long i = 0; i < count; ++i) {
+        uint8_t b, g, r;
+
+        unpackPixel<From>(src + i * PIXEL_SIZE[From], palette, b, g, r);
+        packPixel<To>(dest + i * PIXEL_SIZE[To], b, g, r);
+    }
+}
+
+template <int From>
+static void convertPixels(uint8_t *dest, const uint8_t *src, unsigned long count, const uint8_t *palette, int to) {
+    switch (to) {
+    case PIXEL_BGR888: convertPixels<From, PIXEL_BGR888>(dest, src, count, palette); break;
+    case PIXEL_RGB888: convertPixels<From, PIXEL_RGB888>(dest, src, count, palette); break;
+    case PIXEL_RGB565: convertPixels<From, PIXEL_RGB565>(dest, src, count, palette); break;
+    }
+}
+
+static void convertPixels(uint8_t *dest, const uint8_t *src, unsigned long count, const uint8_t *palette,
+                          int from, int to) {
+    switch (from) {
+    case PIXEL_BGR888: convertPixels<PIXEL_BGR888>(dest, src, count, palette, to); break;
+    case PIXEL_RGB888: convertPixels<PIXEL_RGB888>(dest, src, count, palette, to); break;
+    case PIXEL_RGB565: convertPixels<PIXEL_RGB565>(dest, src, count, palette, to); break;
+    case PIXEL_PAL8: convertPixels<PIXEL_PAL8>(dest, src, count, palette, to); break;
+    }
+}
+
+// Convert one row, in bulk when both ends are in contiguous host memory
+void dma::convertRow(Addr src, bool src_virtual, Addr dest, bool dest_virtual,
+                     Word width, Byte src_format, Byte dest_format, const Byte *palette) {
+    Byte src_size = PIXEL_SIZE[src_format];
+    Byte dest_size = PIXEL_SIZE[dest_format];
+    Addr src_length = (Addr) width * src_size;
+    Addr dest_length = (Addr) width * dest_size;
+    Span s = resolve(src, src_virtual, 0, src_length, false);
+    Span d = resolve(dest, dest_virtual, 0, dest_length, true);
+
+    if (s.host != NULL && d.host != NULL && s.length == src_length && d.length == dest_length) {
+        touch(d.real, dest_length);
+        convertPixels(d.host, s.host, width, palette, src_format, dest_format);
+        return;
+    }
+
+    // A pixel at a time, through the same paths as the CPU
+    for (Word x = 0; x < width; ++x) {
+        Byte in[3], out[3];
+
+        for (Byte i = 0; i < src_size; ++i)
+            in[i] = readReal(resolveReal(src, src_virtual, (Addr) x * src_size + i));
+
+        convertPixels(out, in, 1, palette, src_format, dest_format);
+
+        for (Byte i = 0; i < dest_size; ++i)
+            writeReal(resolveReal(dest, dest_virtual, (Addr) x * dest_size + i), out[i]);
+    }
+}
+
+// Convert a rectangle a row at a time
+dma::Addr dma::convert(Addr src, bool src_virtual, Word src_pitch,
+                       Addr dest, bool dest_virtual, Word dest_pitch,
+                       Word width, Word height, Byte src_format, Byte dest_format,
+                       Addr palette) {
+    if (src_format >= PIXEL_FORMATS || dest_format >= PIXEL_FORMATS || dest_format == PIXEL_PAL8)
+        return 0;
+
+    // Same format, a plain copy
+    if (src_format == dest_format) {
+        blit(src, src_virtual, src_pitch, dest, dest_virtual, dest_pitch,
+             width, height, PIXEL_SIZE[src_format], false, 0);
+        return (Addr) width * PIXEL_SIZE[dest_format] * height;
+    }
+
+    Byte entries[256 * 3];
+
+    if (src_format == PIXEL_PAL8)
+        for (int i = 0; i < 256 * 3; ++i)
+            entries[i] = readReal(resolveReal(palette, src_virtual, i));
+
+    for (Word y = 0; y < height; ++y)
+        convertRow(src + (Addr) y * src_pitch, src_virtual, dest + (Addr) y * dest_pitch, dest_virtual,
+                   width, src_format, dest_format, entries);
+
+    return (Addr) width * PIXEL_SIZE[dest_format] * height;
+}
+
+// Test that every page of a range is host memory
+bool dma::isHost(const Range &range) {
+    for (Addr offset = 0; offset < range.length; ) {
+        unsigned long ea = resolveReal(range.addr, range.is_virtual, offset);
+
+        if ((ea >> PAGE_BITS) >= REAL_PAGES)
+            return false;
+
+        const Page &page = real[ea >> PAGE_BITS];
+
+        if ((range.write ? page.write : page.read) == NULL)
+            return false;
+        offset += PAGE_SIZE - (ea & PAGE_MASK);
+    }
+    return true;
+}
+
+// Wait for the worker and lift the fences
+void dma::settle() {
+    if (worker.joinable())
+        worker.join();
+    unfence();
+}
+
+// Run a request on the worker if all of its ranges can be fenced
+bool dma::start(std::function<void()> job, const Range *ranges, int count, Addr bytes) {
+    settle();
+
+    if (bytes < ASYNC_MIN)
+        return false;
+
+    for (int i = 0; i < count; ++i)
+        if (!isHost(ranges[i]))
+            return false;
+
+    // The pages written are saved here, so the worker never saves one
+    for (int i = 0; i < count; ++i)
+        for (Addr offset = 0; offset < ranges[i].length; ) {
+            unsigned long ea = resolveReal(ranges[i].addr, ranges[i].is_virtual, offset);
+
+            if (ranges[i].write)
+                touch(ea, 1);
+            fence(ea, ranges[i].write);
+            offset += PAGE_SIZE - (ea & PAGE_MASK);
+        }
+
+    fence_handler = settle;
+    refresh();
+
+    worker = std::thread(job);
+    return true;
+}
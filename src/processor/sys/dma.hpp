@@ -0,0 +1,117 @@
+#ifndef DMA_HPP
+#define DMA_HPP
+
+#include "mem816.h"
+
+#include <functional>
+
+// Pixel formats of a converting transfer. The 888 formats are three bytes in
+// memory order, RGB565 a little-endian word. PAL8 pixels index a palette of
+// 256 BGR888 entries and can only be converted from.
+enum PixelFormat {
+    PIXEL_BGR888,
+    PIXEL_RGB888,
+    PIXEL_RGB565,
+    PIXEL_PAL8,
+    PIXEL_FORMATS
+};
+
+// DMA engine for the coprocessor transfer requests, run in-process: on the
+// CPU thread, or for large asynchronous requests on a worker thread while
+// the CPU continues (see start).
+//
+// Each end of a transfer is a CPU address, translated through the page
+// table, or a real address. Ranges are resolved to runs of host memory as
+// long as the pages allow, so a transfer between contiguous RAM is a single
+// memmove (vectorized by the C library). Only ranges whose pages are mapped
+// out of order and alias each other go through an intermediate buffer. Pages
+// without host memory (MMIO, unmapped, ROM as a destination) are transferred
+// a byte at a time through the same paths as the CPU. Real addresses past the
+// end of real memory go to the readb/writeb fallback.
+class dma : public mem816 {
+public:
+    // Cost charged to the CPU for a fill or a conversion, modelled on a
+    // 16-bit bus: a fixed setup plus a cycle for every two bytes written.
+    static const unsigned long SETUP_CYCLES = 8;
+    static const unsigned long BYTES_PER_CYCLE = 2;
+
+    // Transfers below this size are not worth a thread
+    static const unsigned long ASYNC_MIN = 16384;
+
+    // A range read or written by a request, rectangles as their bounds
+    struct Range {
+        Addr addr;
+        bool is_virtual;
+        Addr length;
+        bool write;
+    };
+
+    // Return the cycles a transfer writing bytes holds the bus for
+    static unsigned long busCycles(Addr bytes)
+    {
+        return SETUP_CYCLES + (bytes + BYTES_PER_CYCLE - 1) / BYTES_PER_CYCLE;
+    }
+
+    // Return the bytes per pixel of a format, or 0 if it is not one
+    static Byte pixelSize(Byte format);
+
+    // Run a request on a worker thread while the CPU continues, with the real
+    // pages of its ranges fenced so a CPU access to any of them waits for it
+    // to finish. The CPU therefore always sees the completed transfer, as if
+    // it had run at once. Returns false without running it if a range is not
+    // all host memory or the request is small.
+    static bool start(std::function<void()> job, const Range *ranges, int count, Addr bytes);
+
+    // Wait for the worker, if any, and lift its fences
+    static void settle();
+
+    // Copy size bytes of a range to host memory
+    static void copyOut(Addr src, bool src_virtual, Byte *host, Addr size);
+
+    // Copy size bytes. Overlapping ranges are copied as if through an
+    // intermediate buffer.
+    static void transfer(Addr src, bool src_virtual, Addr dest, bool dest_virtual, Addr size);
+
+    // Copy a rectangle of width pixels of pixel_size (1 to 4) bytes by height
+    // lines. Overlapping rectangles are copied as if through an intermediate
+    // buffer. With keyed set, source pixels equal to key are skipped.
+    static void blit(Addr src, bool src_virtual, Word src_pitch,
+                     Addr dest, bool dest_virtual, Word dest_pitch,
+                     Word width, Word height, Byte pixel_size, bool keyed, uint32_t key);
+
+    // Fill lines of count copies of a 1, 2 or 4 byte pattern (little endian),
+    // pitch bytes apart. Returns the number of bytes written, none if a line
+    // would be over 32 bits long.
+    static Addr fill(Addr dest, bool dest_virtual, Addr count, Word lines, Word pitch,
+                     Byte pattern_size, uint32_t pattern);
+
+    // Copy a rectangle of width pixels by height lines, converting each pixel
+    // from src_format to dest_format. The palette is read for PAL8 sources.
+    // Returns the number of bytes written.
+    static Addr convert(Addr src, bool src_virtual, Word src_pitch,
+                        Addr dest, bool dest_virtual, Word dest_pitch,
+                        Word width, Word height, Byte src_format, Byte dest_format,
+                        Addr palette);
+
+private:
+    // A run of bytes from some offset into a range
+    struct Span {
+        Byte *host;             // Host memory, or NULL for byte access
+        unsigned long real;     // Real address of the first byte
+        Addr length;
+    };
+
+    static bool isHost(const Range &range);
+    static bool isLinear(Addr addr, bool is_virtual, Addr size);
+    static bool sharePage(Addr src, bool src_virtual, Addr dest, bool dest_virtual, Addr size);
+    static unsigned long resolveReal(Addr addr, bool is_virtual, Addr offset);
+    static Span resolve(Addr addr, bool is_virtual, Addr offset, Addr limit, bool write);
+    static void move(const Span &dest, const Span &src, Addr length, bool backward);
+    static void fillRow(Addr dest, bool dest_virtual, Addr length, const Byte *block, Byte pattern_size);
+    static void convertRow(Addr src, bool src_virtual, Addr dest, bool dest_virtual,
+                           Word width, Byte src_format, Byte dest_format, const Byte *palette);
+    static void keyRow(Addr src, bool src_virtual, Addr dest, bool dest_virtual,
+                       Addr length, Byte pixel_size, uint32_t key);
+};
+
+#endif
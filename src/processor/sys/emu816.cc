@@ -25,6 +25,7 @@
 //using namespace std;
 
 #include "emu816.h"
+#include "dma.hpp"
 
 union emu816::FLAGS		emu816::p;
 
@@ -49,6 +50,56 @@ bool					emu816::interrupted;
 unsigned long			emu816::cycles;
 bool					emu816::trace;
 
+unsigned long			emu816::deadline = ~0UL;
+unsigned long			emu816::next_sample = ~0UL;
+
+unsigned long			emu816::dma_done = ~0UL;
+unsigned long			emu816::dma_stolen;
+bool					emu816::dma_irq;
+bool					emu816::dma_irq_pending;
+
+emu816::Addr			emu816::calls[CALL_DEPTH];
+unsigned int			emu816::call_top;
+
+Coverage			   *emu816::coverage[256];
+bool					emu816::covering;
+
+Sample				   *emu816::samples;
+unsigned long			emu816::sample_period;
+unsigned int			emu816::sample_capacity;
+unsigned int			emu816::sample_head;
+unsigned int			emu816::sample_count;
+
+emu816::STATE			emu816::saved;
+emu816::STATE			emu816::checkpoint;
+unsigned long			emu816::checkpoint_cycles;
+emu816::Addr			emu816::checkpoint_calls[CALL_DEPTH];
+unsigned long			emu816::checkpoint_dma_done = ~0UL;
+unsigned long			emu816::checkpoint_dma_stolen;
+bool					emu816::checkpoint_dma_irq;
+bool					emu816::checkpoint_dma_irq_pending;
+
+int						emu816::marker = -1;
+emu816::Addr			emu816::marker_pc = ~0UL;
+
+// The DMA status register reads 1 while an asynchronous request is in flight.
+// Reading it acknowledges the completion IRQ.
+static mem816::Byte readDma(void *, mem816::Addr ea)
+{
+	if ((ea & 0x0f) != 0)
+		return (0);
+
+	emu816::acknowledgeDma();
+	return (emu816::isDmaBusy() ? 1 : 0);
+}
+
+// Make the DMA status register available to memory maps
+static struct DmaInit {
+	DmaInit() {
+		mem816::addDevice("DMA", readDma, NULL, NULL);
+	}
+} dma_init;
+
 //==============================================================================
 
 // Not used.
@@ -62,6 +113,12 @@ emu816::~emu816()
 // Reset the state of emulator
 void emu816::reset(bool trace)
 {
+	dma::settle();
+	ppu::reset();
+	dma_done = ~0UL;
+	dma_irq_pending = false;
+	deadline = next_sample;
+
 	e = 1;
 	pbr = 0x00;
 	dbr = 0x00;
@@ -73,24 +130,369 @@ void emu816::reset(bool trace)
 	stopped = false;
 	stop_reason = StopReason::RUNNING;
 	interrupted = false;
+	faulted = false;
+
+	call_top = 0;
+	pushCall(join(pbr, pc));
+
+	metrics::resume();
 
 	emu816::trace = trace;
 }
 
+// Start, restart or stop the sampling profiler
+void emu816::setSampling(unsigned long period, unsigned int capacity)
+{
+	free(samples);
+	samples = NULL;
+	sample_capacity = sample_head = sample_count = 0;
+	sample_period = 0;
+	next_sample = ~0UL;
+	deadline = dma_done;
+
+	if (period == 0 || capacity == 0)
+		return;
+
+	samples = (Sample *) malloc(capacity * sizeof(Sample));
+	if (samples == NULL)
+		return;
+
+	sample_capacity = capacity;
+	sample_period = period;
+	next_sample = cycles + period;
+	if (next_sample < deadline)
+		deadline = next_sample;
+}
+
+// Copy out the buffered samples, oldest first, and empty the buffer
+unsigned int emu816::getSamples(Sample *dest, unsigned int count)
+{
+	unsigned int first = (sample_head + sample_capacity - sample_count) % (sample_capacity ? sample_capacity : 1);
+	unsigned int n = (count < sample_count) ? count : sample_count;
+
+	for (unsigned int i = 0; i < n; ++i)
+		dest[i] = samples[(first + i) % sample_capacity];
+
+	sample_count -= n;
+	return (n);
+}
+
+// Save the CPU state and start tracking memory writes against it
+void emu816::snapshot()
+{
+	save();
+	checkpoint = saved;
+	checkpoint_cycles = cycles;
+	std::memcpy(checkpoint_calls, calls, sizeof(calls));
+	checkpoint_dma_done = dma_done;
+	checkpoint_dma_stolen = dma_stolen;
+	checkpoint_dma_irq = dma_irq;
+	checkpoint_dma_irq_pending = dma_irq_pending;
+
+	snapshotMemory();
+}
+
+// Return to the last snapshot. The CPU is left running, with no interrupt
+// pending.
+unsigned int emu816::rollback()
+{
+	saved = checkpoint;
+	restore();
+	std::memcpy(calls, checkpoint_calls, sizeof(calls));
+	cycles = checkpoint_cycles;
+	dma_done = checkpoint_dma_done;
+	dma_stolen = checkpoint_dma_stolen;
+	dma_irq = checkpoint_dma_irq;
+	dma_irq_pending = checkpoint_dma_irq_pending;
+	deadline = (next_sample < dma_done) ? next_sample : dma_done;
+
+	stopped = false;
+	stop_reason = StopReason::RUNNING;
+	interrupted = false;
+	faulted = false;
+
+	return (rollbackMemory());
+}
+
+// Arm or disarm the one-shot marker
+void emu816::setMarker(int signature, Addr pc)
+{
+	marker = signature;
+	marker_pc = pc;
+}
+
+// Start recording coverage with cleared flags, or stop and free them
+void emu816::setCoverage(bool enable)
+{
+	for (int b = 0; b < 256; ++b) {
+		free(coverage[b]);
+		coverage[b] = NULL;
+	}
+	covering = enable;
+}
+
+// Allocate the flags of a bank on the first instruction fetched from it
+Coverage *emu816::addCoverage(Byte bank)
+{
+	coverage[bank] = (Coverage *) calloc(1, sizeof(Coverage));
+	return (coverage[bank]);
+}
+
+// Service a coprocessor request in-process. Returns false if the request must
+// be passed to the host by halting.
+bool emu816::serviceCop()
+{
+	// Requests may remap pages or read memory the worker is writing
+	dma::settle();
+
+	switch (cop_op & ~DMA_FLAGS) {
+	case COP_MMU_MAP_BANKS:
+		for (int i = 0; i + 1 < cop_size; i += 2)
+			mapBank(lo(cop[i]), cop[i + 1]);
+		return (true);
+
+	case COP_MMU_MAP_PAGES:
+		for (int i = 0; i + 2 < cop_size; i += 3)
+			mapPage(cop[i], cop[i + 1], lo(cop[i + 2]));
+		return (true);
+
+	// Source, destination and size as 32-bit values
+	case COP_MMU_DMA_TRANSFERB_VR:
+	case COP_MMU_DMA_TRANSFERB_V:
+	case COP_MMU_DMA_TRANSFERB_R:
+		if (cop_size == 6) {
+			Addr src = copLong(0), dest = copLong(2), size = copLong(4);
+			bool src_virtual = (cop_op & ~DMA_FLAGS) != COP_MMU_DMA_TRANSFERB_R;
+			bool dest_virtual = (cop_op & ~DMA_FLAGS) == COP_MMU_DMA_TRANSFERB_V;
+			dma::Range ranges[] = {
+				{ src, src_virtual, size, false },
+				{ dest, dest_virtual, size, true }
+			};
+
+			requestDma([=] {
+				dma::transfer(src, src_virtual, dest, dest_virtual, size);
+			}, ranges, 2, size, false);
+		}
+		return (true);
+
+	// Source, destination, width, height, source pitch, destination pitch,
+	// pixel size and flags, then the key if BLIT_KEYED is set
+	case COP_DMA_BLIT:
+		if (cop_size >= 9) {
+			Byte flags = hi(cop[8]);
+			bool keyed = (flags & BLIT_KEYED) && cop_size >= 11;
+			Addr src = copLong(0), dest = copLong(2), key = keyed ? copLong(9) : 0;
+			Word width = cop[4], height = cop[5], src_pitch = cop[6], dest_pitch = cop[7];
+			Byte pixel_size = lo(cop[8]);
+			Addr length = (Addr) width * pixel_size;
+			dma::Range ranges[] = {
+				{ src, !(flags & BLIT_SRC_REAL), height ? (Addr) (height - 1) * src_pitch + length : 0, false },
+				{ dest, !(flags & BLIT_DEST_REAL), height ? (Addr) (height - 1) * dest_pitch + length : 0, true }
+			};
+
+			requestDma([=] {
+				dma::blit(src, !(flags & BLIT_SRC_REAL), src_pitch, dest, !(flags & BLIT_DEST_REAL), dest_pitch,
+					width, height, pixel_size, keyed, key);
+			}, ranges, 2, length * height, false);
+		}
+		return (true);
+
+	// Destination, count, lines, pitch, pattern size and flags, pattern
+	case COP_DMA_FILL:
+		if (cop_size >= 9) {
+			Addr dest = copLong(0), count = copLong(2), pattern = copLong(7);
+			Word lines = cop[4], pitch = cop[5];
+			Byte size = lo(cop[6]);
+			bool dest_virtual = !(hi(cop[6]) & FILL_DEST_REAL);
+
+			// A line longer than 32 bits is refused rather than truncated
+			if (size != 0 && count > 0xffffffffUL / size)
+				return (true);
+
+			Addr length = (size == 1 || size == 2 || size == 4) ? count * size : 0;
+			dma::Range ranges[] = {
+				{ dest, dest_virtual, lines ? (Addr) (lines - 1) * pitch + length : 0, true }
+			};
+
+			requestDma([=] {
+				dma::fill(dest, dest_virtual, count, lines, pitch, size, pattern);
+			}, ranges, 1, length * lines, true);
+		}
+		return (true);
+
+	// Source, destination, width, height, source pitch, destination pitch,
+	// formats, flags, then the palette for a PIXEL_PAL8 source
+	case COP_DMA_CONVERT:
+		if (cop_size >= 10) {
+			Addr src = copLong(0), dest = copLong(2), palette = cop_size >= 12 ? copLong(10) : 0;
+			Word width = cop[4], height = cop[5], src_pitch = cop[6], dest_pitch = cop[7];
+			Byte src_format = lo(cop[8]), dest_format = hi(cop[8]);
+			bool src_virtual = !(cop[9] & CONVERT_SRC_REAL), dest_virtual = !(cop[9] & CONVERT_DEST_REAL);
+			Addr src_length = (Addr) width * dma::pixelSize(src_format);
+			Addr dest_length = (Addr) width * dma::pixelSize(dest_format);
+
+			if (src_length == 0 || dest_format == PIXEL_PAL8)
+				dest_length = 0;
+			dma::Range ranges[] = {
+				{ src, src_virtual, height ? (Addr) (height - 1) * src_pitch + src_length : 0, false },
+				{ dest, dest_virtual, height ? (Addr) (height - 1) * dest_pitch + dest_length : 0, true },
+				{ palette, src_virtual, 256 * 3, false }
+			};
+
+			requestDma([=] {
+				dma::convert(src, src_virtual, src_pitch, dest, dest_virtual, dest_pitch,
+					width, height, src_format, dest_format, palette);
+			}, ranges, src_format == PIXEL_PAL8 ? 3 : 2, dest_length * height, true);
+		}
+		return (true);
+
+	default:
+		return (false);
+	}
+}
+
+// Run a DMA request now, or on the worker if it is asynchronous. An
+// asynchronous request completes once the bus would be done with it; another
+// request before then stalls the CPU until it has. Synchronous fills and
+// conversions charge the CPU for the bus.
+void emu816::requestDma(std::function<void()> job, const dma::Range *ranges, int count,
+	Addr bytes, bool charge)
+{
+#ifdef EMU816_DMA_LIMIT
+	// Fuzz builds bound the work a single instruction can do
+	for (int i = 0; i < count; ++i)
+		if (ranges[i].length > EMU816_DMA_LIMIT)
+			return;
+	if (bytes > EMU816_DMA_LIMIT)
+		return;
+#endif
+
+	if (!(cop_op & DMA_ASYNC)) {
+		job();
+		if (charge)
+			cycles += dma::busCycles(bytes);
+		return;
+	}
+
+	if (dma_done != ~0UL) {
+		if (cycles < dma_done)
+			cycles = dma_done;
+		completeDma();
+	}
+
+	if (!dma::start(job, ranges, count, bytes))
+		job();
+
+	dma_done = cycles + dma::busCycles(bytes);
+	dma_stolen = (cop_op & DMA_CONTEND) ? dma::busCycles(bytes) / 2 : 0;
+	dma_irq = cop_op & DMA_IRQ;
+
+	if (dma_done < deadline)
+		deadline = dma_done;
+}
+
+// Complete the asynchronous DMA request at its cycle. With DMA_CONTEND the
+// transfer is taken to have had every other bus cycle, which the CPU pays for
+// here.
+void emu816::completeDma()
+{
+	cycles += dma_stolen;
+	dma_done = ~0UL;
+
+	if (dma_irq)
+		dma_irq_pending = true;
+}
+
+// Abandon the instruction that faulted and enter the ABORT handler. The
+// registers are restored to their values before the instruction, so the
+// address pushed is that of the instruction itself and RTI restarts it.
+// Memory written before the fault (the first byte of a word that straddles a
+// protected page) is not rolled back. A fault while entering the handler
+// stops the processor.
+void emu816::abort()
+{
+	restore();
+
+	faulted = false;
+
+	if (e) {
+		pushWord(pc);
+		pushByte(p.b & ~0x10);
+
+		p.f_i = 1;
+		p.f_d = 0;
+		pbr = 0;
+
+		pc = getWord(0xfff8);
+		cycles += 7;
+	}
+	else {
+		pushByte(pbr);
+		pushWord(pc);
+		pushByte(p.b);
+
+		p.f_i = 1;
+		p.f_d = 0;
+		pbr = 0;
+
+		pc = getWord(0xffe8);
+		cycles += 8;
+	}
+	pushCall(pc);
+	metrics::interrupt();
+
+	if (faulted) {
+		faulted = false;
+		halt(StopReason::STOP);
+	}
+}
+
+// Called from step() once cycles passes the deadline, to complete the DMA
+// request or take a sample. The buffer is preallocated so taking a sample
+// never allocates; when it is full the oldest sample is overwritten.
+void emu816::onDeadline()
+{
+	if (cycles >= dma_done)
+		completeDma();
+
+	if (sample_period != 0 && cycles >= next_sample) {
+		Sample &s = samples[sample_head];
+
+		s.pc = join(pbr, pc);
+		s.func = topCall();
+		s.p = p.b;
+		s.e = e;
+
+		sample_head = (sample_head + 1) % sample_capacity;
+		if (sample_count < sample_capacity)
+			++sample_count;
+
+		next_sample = cycles + sample_period;
+	}
+
+	deadline = (next_sample < dma_done) ? next_sample : dma_done;
+}
+
 // Execute a single instruction or invoke an interrupt
 void emu816::step()
 {
-	// Check for NMI/IRQ
+	// Complete a DMA request or take a sample once due
+	if (cycles >= deadline)
+		onDeadline();
 
 	SHOWPC();
 
-	if (interrupted) {
+	// Check for NMI/IRQ. A host IRQ is lost while IRQs are masked, but a DMA
+	// completion holds its line until the handler is entered.
+	if (interrupted || dma_irq_pending) {
 		interrupted = false;
 		stop_reason = StopReason::RUNNING;
 
 		if (stop_reason == StopReason::WAIT_INTERRUPT && p.f_i == 1) {
 			//pc++;
 		} else if (p.f_i == 0) {
+			dma_irq_pending = false;
+
 			if (e) {
 				pushWord(pc);
 				pushByte(p.b | 0x10);
@@ -101,6 +503,8 @@ void emu816::step()
 
 				pc = getWord(0xfffe);
 				cycles += 7;
+				pushCall(pc);
+				metrics::interrupt();
 			}
 			else {
 				pushByte(pbr);
@@ -113,10 +517,42 @@ void emu816::step()
 
 				pc = getWord(0xffee);
 				cycles += 8;
+				pushCall(pc);
+				metrics::interrupt();
 			}
 		}
 	}
 
+	if (join(pbr, pc) == marker_pc) {
+		marker = -1;
+		marker_pc = ~0UL;
+		halt(StopReason::MARKER);
+		return;
+	}
+
+	// Only protected pages can fault, so the snapshot is skipped until some
+	// page has restricted rights
+	if (protecting) {
+		if (faulted) {
+			// Interrupt entry faulted
+			faulted = false;
+			halt(StopReason::STOP);
+			return;
+		}
+
+		save();
+
+		if (!canExecute(join(pbr, pc))) {
+			fault(join(pbr, pc), MMU_EXEC);
+			abort();
+			metrics::retire(cycles);
+			return;
+		}
+	}
+
+	if (covering)
+		coverFetch();
+
 	switch (getByte (join(pbr, pc++))) {
 	case 0x00:	op_brk(am_immb());	break;
 	case 0x01:	op_ora(am_dpix());	break;
@@ -390,6 +826,27 @@ void emu816::step()
 	case 0xfe:	op_inc(am_absx());	break;
 	case 0xff:	op_sbc(am_alnx());	break;
 	}
+
+	if (faulted)
+		abort();
+
+	metrics::retire(cycles);
+}
+
+// Execute up to count instructions, returning early if the CPU stops or the
+// cycle counter reaches limit. Returns the number of instructions executed.
+unsigned long emu816::run(unsigned long count, unsigned long limit)
+{
+	unsigned long done = 0;
+
+	while (!stopped && done < count && cycles < limit) {
+		step();
+		++done;
+	}
+
+	// The host may look at memory once run returns
+	dma::settle();
+	return (done);
 }
 
 //==============================================================================
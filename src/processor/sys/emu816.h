@@ -23,6 +23,8 @@
 #define EMU816_H
 
 #include "mem816.h"
+#include "dma.hpp"
+#include "ppu.hpp"
 
 #include <stdlib.h>
 #include <stdint.h>
@@ -45,7 +47,73 @@ enum StopReason {
 	RUNNING,
 	COPROCESSOR,
 	WAIT_INTERRUPT,
-	STOP
+	STOP,
+	MARKER
+};
+
+// Coprocessor operations, numbered as CoprocessorOpcode on the host side.
+enum CopOpcode {
+	COP_MMU_MAP_BANKS,
+	COP_MMU_DMA_TRANSFERB_VR,
+	COP_MMU_DMA_TRANSFERB_V,
+	COP_MMU_DMA_TRANSFERB_R,
+	COP_MMU_MAP_PAGES,
+	COP_DMA_BLIT,
+	COP_DMA_FILL,
+	COP_DMA_CONVERT,
+	COP_FRAME_PRESENT			// Served by the host
+};
+
+// Flags in the high bits of the opcode of a DMA request. An asynchronous
+// request returns at once and completes when the bus would be done with it;
+// the others apply to asynchronous requests only.
+enum DmaFlags {
+	DMA_CONTEND = 0x20,			// Charge the CPU for the cycles the transfer steals
+	DMA_IRQ = 0x40,				// Raise an IRQ on completion, held until taken
+	DMA_ASYNC = 0x80,			// Run on a worker thread
+	DMA_FLAGS = 0xe0
+};
+
+// Flags in the high byte of the pixel size argument of COP_DMA_BLIT.
+enum BlitFlags {
+	BLIT_SRC_REAL = 0x01,		// Source is a real address
+	BLIT_DEST_REAL = 0x02,		// Destination is a real address
+	BLIT_KEYED = 0x04			// Skip source pixels equal to the key
+};
+
+// Flags in the high byte of the pattern size argument of COP_DMA_FILL.
+enum FillFlags {
+	FILL_DEST_REAL = 0x01		// Destination is a real address
+};
+
+// Flags argument of COP_DMA_CONVERT.
+enum ConvertFlags {
+	CONVERT_SRC_REAL = 0x01,	// Source and palette are real addresses
+	CONVERT_DEST_REAL = 0x02	// Destination is a real address
+};
+
+// Coverage flags of an address.
+enum CoverageFlags {
+	COVER_EXECUTED = 1,			// An instruction was fetched here
+	COVER_TAKEN = 2,			// The branch here was taken
+	COVER_NOT_TAKEN = 4			// The branch here fell through
+};
+
+// Coverage of one bank, a nibble of CoverageFlags per address, even addresses
+// in the low nibble. A branch's flags share the cache line of its fetch.
+struct Coverage {
+	uint8_t			flags[32768];
+};
+
+// Depth of the shadow call stack used to attribute profiler samples.
+#define CALL_DEPTH	64
+
+// A single profiler sample, laid out for sharing over the FFI.
+struct Sample {
+	uint32_t		pc;			// Full 24-bit PBR:PC of the next instruction
+	uint32_t		func;		// Entry point at the top of the shadow call stack
+	uint8_t			p;			// Status register (holds M and X)
+	uint8_t			e;			// Emulation flag
 };
 
 // Defines the WDC 65C816 emulator.
@@ -58,6 +126,7 @@ public:
 	
 	static void reset(bool trace);
 	static void step();
+	static unsigned long run(unsigned long count, unsigned long limit = ~0UL);
 
 	INLINE static unsigned long getCycles()
 	{
@@ -72,6 +141,7 @@ public:
 	INLINE static void resume()
 	{
 		stopped = false;
+		metrics::resume();
 	}
 
 	INLINE static StopReason getStopReason()
@@ -84,6 +154,18 @@ public:
 		interrupted = true;
 	}
 
+	// Test if an asynchronous DMA request has yet to complete
+	INLINE static bool isDmaBusy()
+	{
+		return (dma_done != ~0UL && cycles < dma_done);
+	}
+
+	// Drop the IRQ line of a completed DMA request
+	INLINE static void acknowledgeDma()
+	{
+		dma_irq_pending = false;
+	}
+
 	INLINE static Byte getCopInstSize() {
 		return (cop_size);
 	}
@@ -99,6 +181,35 @@ public:
 		return cop_op;
 	}
 
+	// Record a sample every period cycles into a ring of capacity entries.
+	// A period of zero disables sampling.
+	static void setSampling(unsigned long period, unsigned int capacity);
+
+	// Drain up to count samples (oldest first) and return how many were copied.
+	static unsigned int getSamples(Sample *dest, unsigned int count);
+
+	// Save the CPU state and start tracking memory writes.
+	static void snapshot();
+
+	// Return the CPU and the memory written since to the last snapshot.
+	// Returns the number of pages restored.
+	static unsigned int rollback();
+
+	// Halt with MARKER after a WDM with the given signature byte or before
+	// the instruction at pc, once. A negative signature or a pc outside the
+	// 24-bit space disables either.
+	static void setMarker(int signature, Addr pc);
+
+	// Start recording coverage with cleared flags, or stop and free them.
+	static void setCoverage(bool enable);
+
+	// Return the coverage flags of a bank, or NULL if no instruction has
+	// executed in it.
+	INLINE static const Coverage *getCoverage(Byte bank)
+	{
+		return (coverage[bank]);
+	}
+
 private:
 	static union FLAGS {
 		struct {
@@ -132,6 +243,52 @@ private:
 	static unsigned long cycles;
 	static bool		trace;
 
+	// Cycle count at which onDeadline() is next invoked by step(), the
+	// earlier of the next sample and the DMA completion
+	static unsigned long deadline;
+	static unsigned long next_sample;
+
+	// Completion of the asynchronous DMA request
+	static unsigned long dma_done;
+	static unsigned long dma_stolen;
+	static bool		dma_irq;
+	static bool		dma_irq_pending;		// Held until taken or acknowledged
+
+	static Addr		calls[CALL_DEPTH];
+	static unsigned int	call_top;
+
+	static Sample  *samples;
+	static unsigned long sample_period;
+	static unsigned int	sample_capacity, sample_head, sample_count;
+
+	static Coverage *coverage[256];
+	static bool		covering;
+
+	static int		marker;
+	static Addr		marker_pc;
+
+	// Registers at the start of the instruction, restored by an ABORT
+	static struct STATE {
+		REGS			a, x, y, sp, dp;
+		Word			pc;
+		Byte			pbr, dbr, p;
+		Bit				e;
+		unsigned int	call_top;
+	}   saved, checkpoint;
+
+	static unsigned long checkpoint_cycles;
+	static Addr		checkpoint_calls[CALL_DEPTH];
+	static unsigned long checkpoint_dma_done, checkpoint_dma_stolen;
+	static bool		checkpoint_dma_irq, checkpoint_dma_irq_pending;
+
+	static void onDeadline();
+	static void abort();
+	static Coverage *addCoverage(Byte bank);
+	static bool serviceCop();
+	static void requestDma(std::function<void()> job, const dma::Range *ranges, int count,
+		Addr bytes, bool charge);
+	static void completeDma();
+
 	static void show();
 	static void bytes(unsigned int);
 	static void dump(const char *, Addr);
@@ -174,6 +331,98 @@ private:
 		return (join(l, h));
 	}
 
+	// Mark the instruction at PBR:PC as executed
+	INLINE static void coverFetch()
+	{
+		Coverage *c = coverage[pbr];
+
+		if (c == NULL && (c = addCoverage(pbr)) == NULL)
+			return;
+		c->flags[pc >> 1] |= COVER_EXECUTED << ((pc & 1) * 4);
+	}
+
+	// Mark the direction of the relative branch just decoded
+	INLINE static void coverBranch(bool taken)
+	{
+		Coverage *c = coverage[pbr];
+
+		if (covering && c != NULL) {
+			Word at = pc - 2;
+
+			c->flags[at >> 1] |= (taken ? COVER_TAKEN : COVER_NOT_TAKEN) << ((at & 1) * 4);
+		}
+	}
+
+	// Halt execution until the host calls resume()
+	INLINE static void halt(StopReason reason)
+	{
+		stopped = true;
+		stop_reason = reason;
+		metrics::stop(reason);
+	}
+
+	// Return the 32-bit coprocessor argument in words i and i + 1
+	INLINE static Addr copLong(int i)
+	{
+		return (((Addr) cop[i + 1] << 16) | cop[i]);
+	}
+
+	// Save the registers before an instruction that may fault
+	INLINE static void save()
+	{
+		saved.a = a;
+		saved.x = x;
+		saved.y = y;
+		saved.sp = sp;
+		saved.dp = dp;
+		saved.pc = pc;
+		saved.pbr = pbr;
+		saved.dbr = dbr;
+		saved.p = p.b;
+		saved.e = e;
+		saved.call_top = call_top;
+	}
+
+	// Restore the registers saved by save()
+	INLINE static void restore()
+	{
+		a = saved.a;
+		x = saved.x;
+		y = saved.y;
+		sp = saved.sp;
+		dp = saved.dp;
+		pc = saved.pc;
+		pbr = saved.pbr;
+		dbr = saved.dbr;
+		p.b = saved.p;
+		e = saved.e;
+		call_top = saved.call_top;
+	}
+
+	// Note entry to a subroutine or handler on the shadow call stack
+	INLINE static void pushCall(Addr target)
+	{
+		if (call_top < CALL_DEPTH)
+			calls[call_top] = target;
+		++call_top;
+	}
+
+	// Note a return from the subroutine at the top of the shadow call stack
+	INLINE static void pullCall()
+	{
+		if (call_top > 0)
+			--call_top;
+	}
+
+	// Return the entry point of the innermost known subroutine
+	INLINE static Addr topCall()
+	{
+		if (call_top == 0)
+			return (0);
+
+		return (calls[(call_top < CALL_DEPTH ? call_top : CALL_DEPTH) - 1]);
+	}
+
 	// Absolute - a
 	INLINE static Addr am_absl()
 	{
@@ -584,6 +833,7 @@ private:
 	{
 		TRACE("BCC");
 
+		coverBranch(p.f_c == 0);
 		if (p.f_c == 0) {
 			if (e && ((pc ^ ea) & 0xff00)) ++cycles;
 			pc = (Word)ea;
@@ -597,6 +847,7 @@ private:
 	{
 		TRACE("BCS");
 
+		coverBranch(p.f_c == 1);
 		if (p.f_c == 1) {
 			if (e && ((pc ^ ea) & 0xff00)) ++cycles;
 			pc = (Word)ea;
@@ -610,6 +861,7 @@ private:
 	{
 		TRACE("BEQ");
 
+		coverBranch(p.f_z == 1);
 		if (p.f_z == 1) {
 			if (e && ((pc ^ ea) & 0xff00)) ++cycles;
 			pc = (Word)ea;
@@ -663,6 +915,7 @@ private:
 	{
 		TRACE("BMI");
 
+		coverBranch(p.f_n == 1);
 		if (p.f_n == 1) {
 			if (e && ((pc ^ ea) & 0xff00)) ++cycles;
 			pc = (Word)ea;
@@ -676,6 +929,7 @@ private:
 	{
 		TRACE("BNE");
 
+		coverBranch(p.f_z == 0);
 		if (p.f_z == 0) {
 			if (e && ((pc ^ ea) & 0xff00)) ++cycles;
 			pc = (Word)ea;
@@ -689,6 +943,7 @@ private:
 	{
 		TRACE("BPL");
 
+		coverBranch(p.f_n == 0);
 		if (p.f_n == 0) {
 			if (e && ((pc ^ ea) & 0xff00)) ++cycles;
 			pc = (Word)ea;
@@ -702,6 +957,7 @@ private:
 	{
 		TRACE("BRA");
 
+		coverBranch(true);
 		if (e && ((pc ^ ea) & 0xff00)) ++cycles;
 		pc = (Word)ea;
 		cycles += 3;
@@ -734,6 +990,7 @@ private:
 			pc = getWord(0xffe6);
 			cycles += 8;
 		}
+		pushCall(pc);
 	}
 
 	INLINE static void op_brl(Addr ea)
@@ -748,6 +1005,7 @@ private:
 	{
 		TRACE("BVC");
 
+		coverBranch(p.f_v == 0);
 		if (p.f_v == 0) {
 			if (e && ((pc ^ ea) & 0xff00)) ++cycles;
 			pc = (Word)ea;
@@ -761,6 +1019,7 @@ private:
 	{
 		TRACE("BVS");
 
+		coverBranch(p.f_v == 1);
 		if (p.f_v == 1) {
 			if (e && ((pc ^ ea) & 0xff00)) ++cycles;
 			pc = (Word)ea;
@@ -828,9 +1087,6 @@ private:
 	{
 		TRACE("COP");
 
-		stopped = true;
-		stop_reason = StopReason::COPROCESSOR;
-
 		cop_size = getByte(ea);
 		cop_op = getByte(++ea); ++ea;
 		pc += 1 + cop_size * 2;
@@ -841,6 +1097,25 @@ private:
 			cop[i] = getWord(ea + j);
 		}
 
+		// The arguments could not be read, step() will raise an ABORT
+		if (faulted) {
+			free(cop);
+			cop = NULL;
+			cop_size = 0;
+			return;
+		}
+
+		metrics::cop(cop_op);
+
+		if (serviceCop()) {
+			free(cop);
+			cop = NULL;
+			cop_size = 0;
+			return;
+		}
+
+		halt(StopReason::COPROCESSOR);
+
 		/*
 			if (e) {
 				pushWord(pc);
@@ -1056,6 +1331,7 @@ private:
 
 		pbr = lo(ea >> 16);
 		pc = (Word)ea;
+		pushCall(ea);
 		cycles += 5;
 	}
 
@@ -1066,6 +1342,7 @@ private:
 		pushWord(pc - 1);
 
 		pc = (Word)ea;
+		pushCall(join(pbr, pc));
 		cycles += 4;
 	}
 
@@ -1487,6 +1764,7 @@ private:
 			cycles += 7;
 		}
 		p.f_i = 0;
+		pullCall();
 	}
 
 	INLINE static void op_rtl(Addr ea)
@@ -1495,6 +1773,7 @@ private:
 
 		pc = pullWord() + 1;
 		pbr = pullByte();
+		pullCall();
 		cycles += 6;
 	}
 
@@ -1503,6 +1782,7 @@ private:
 		TRACE("RTS");
 
 		pc = pullWord() + 1;
+		pullCall();
 		cycles += 6;
 	}
 
@@ -1606,8 +1886,7 @@ private:
 			interrupted = false;
 		*/
 
-		stopped = true;
-		stop_reason = StopReason::STOP;
+		halt(StopReason::STOP);
 
 		cycles += 3;
 	}
@@ -1834,8 +2113,7 @@ private:
 	{
 		TRACE("WAI");
 
-		stopped = true;
-		stop_reason = StopReason::WAIT_INTERRUPT;
+		halt(StopReason::WAIT_INTERRUPT);
 
 		cycles += 3;
 	}
@@ -1844,8 +2122,13 @@ private:
 	{
 		TRACE("WDM");
 
-		// this opcode is reserved, nop
-		
+		// this opcode is reserved, nop, except as a marker
+		if (marker >= 0 && getByte(ea) == marker) {
+			marker = -1;
+			marker_pc = ~0UL;
+			halt(StopReason::MARKER);
+		}
+
 		cycles += 3;
 	}
 
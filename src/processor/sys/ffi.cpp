@@ -1,4 +1,8 @@
 #include "emu816.h"
+#include "perf.hpp"
+#include "metrics.hpp"
+
+static bool measuring;
 
 extern "C" {
     void emu816_reset(bool trace) {
@@ -9,7 +13,20 @@ extern "C" {
         emu816::step();
     }
 
-    unsigned long emu816_getCycles() {
+    unsigned int emu816_run(unsigned int count, uint64_t limit) {
+        if (!measuring)
+            return emu816::run(count, limit);
+
+        unsigned long cycles = emu816::getCycles();
+
+        perf::begin();
+        unsigned long done = emu816::run(count, limit);
+        perf::end(done, emu816::getCycles() - cycles);
+
+        return done;
+    }
+
+    uint64_t emu816_getCycles() {
         return emu816::getCycles();
     }
 
@@ -36,4 +53,67 @@ extern "C" {
     unsigned char emu816_getCopInst(unsigned short *inst) {
         return emu816::getCopInst(inst);
     }
+
+    void emu816_setSampling(unsigned int period, unsigned int capacity) {
+        emu816::setSampling(period, capacity);
+    }
+
+    unsigned int emu816_getSamples(Sample *dest, unsigned int count) {
+        return emu816::getSamples(dest, count);
+    }
+
+    bool emu816_setPerfCounters(bool enable) {
+        measuring = enable;
+
+        if (!enable) {
+            perf::close();
+            return false;
+        }
+
+        return perf::open();
+    }
+
+    void emu816_getPerfCounters(PerfCounters *dest) {
+        perf::get(dest);
+    }
+
+    void emu816_setCoverage(bool enable) {
+        emu816::setCoverage(enable);
+    }
+
+    void emu816_setMarker(int signature, uint32_t pc) {
+        emu816::setMarker(signature, pc);
+    }
+
+    const Coverage *emu816_getCoverage(unsigned char bank) {
+        return emu816::getCoverage(bank);
+    }
+
+    int emu816_loadMemoryMap(const char *text, unsigned char *memory, uint32_t size) {
+        return emu816::loadMap(text, memory, size);
+    }
+
+    void emu816_mapHost(uint32_t start, uint32_t size, unsigned char *host, bool writable) {
+        emu816::mapHost(start, size, host, writable);
+    }
+
+    void emu816_watch(uint32_t start, uint32_t size) {
+        emu816::watch(start, size);
+    }
+
+    void emu816_takeDirty(uint32_t start, uint32_t size, uint64_t *bits) {
+        emu816::takeDirty(start, size, bits);
+    }
+
+    bool emu816_renderPpu() {
+        return ppu::render();
+    }
+
+    uint32_t emu816_translate(uint32_t addr) {
+        return emu816::translate(addr);
+    }
+
+    void emu816_getMetrics(MetricsSnapshot *dest) {
+        metrics::snapshot(dest);
+    }
 }
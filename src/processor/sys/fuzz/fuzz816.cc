@@ -0,0 +1,201 @@
+// libFuzzer entry point for the emu816 core.
+//
+// The guest is booted once and a snapshot of the CPU and memory is taken.
+// Each input is then run from the snapshot and afterwards only the pages it
+// wrote are restored, so an execution costs in proportion to the memory it
+// touches instead of a reset and a reload of the images.
+//
+// Configured from the environment:
+//
+//   FUZZ816_IMAGE   image loaded so that it ends at the top of bank 0, with
+//                   the vectors. The guest runs until a WDM with the marker
+//                   signature, where the snapshot is taken, and each input
+//                   is written at FUZZ816_INPUT preceded by its 16-bit
+//                   length. Without an image the input itself is executed
+//                   from $1000 in emulation mode, to fuzz the decoder.
+//   FUZZ816_MARKER  WDM signature byte that ends the boot (default $42)
+//   FUZZ816_INPUT   address of the input (default $020000)
+//   FUZZ816_CYCLES  cycles each input may run for (default 100000)
+//
+// Built with -DFUZZ816_MAIN it is a standalone driver that runs the files
+// given as arguments and reports the execution rate.
+//
+// The cycle budget cannot bound a DMA request, which runs inside a single
+// COP, so the core is built with EMU816_DMA_LIMIT and ignores requests
+// larger than that.
+
+#include "emu816.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sys/mman.h>
+
+static const uint32_t MEMORY_SIZE = 1 << 24;
+static const uint32_t CODE = 0x1000;
+static const uint32_t CODE_END = 0xF000;
+static const uint32_t HALT = 0x0F00;
+
+static uint8_t *memory;
+static bool image;
+static uint32_t input = 0x020000;
+static unsigned long cycles = 100000;
+
+extern "C" {
+    uint8_t readb(uint32_t) {
+        return 0;
+    }
+
+    void writeb(uint32_t, uint8_t) {
+    }
+}
+
+static unsigned long env(const char *name, unsigned long value) {
+    const char *text = std::getenv(name);
+
+    return text != NULL ? std::strtoul(text, NULL, 0) : value;
+}
+
+// Load the image so it ends at $010000, returning false if it cannot be read
+static bool load(const char *path) {
+    FILE *file = std::fopen(path, "rb");
+
+    if (file == NULL)
+        return false;
+
+    std::fseek(file, 0, SEEK_END);
+    long size = std::ftell(file);
+    std::fseek(file, 0, SEEK_SET);
+
+    bool loaded = size > 0 && size <= 0x10000 &&
+        std::fread(memory + 0x10000 - size, 1, size, file) == (size_t) size;
+
+    std::fclose(file);
+    return loaded;
+}
+
+extern "C" int LLVMFuzzerInitialize(int *, char ***) {
+    memory = (uint8_t *) mmap(NULL, MEMORY_SIZE, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (memory == MAP_FAILED) {
+        std::perror("fuzz816: mmap");
+        std::exit(1);
+    }
+
+    emu816::loadMap("MEMORY { RAM: start = $0, size = $1000000; }", memory, MEMORY_SIZE);
+
+    input = env("FUZZ816_INPUT", input);
+    cycles = env("FUZZ816_CYCLES", cycles);
+
+    const char *path = std::getenv("FUZZ816_IMAGE");
+
+    if (path != NULL) {
+        if (!load(path)) {
+            std::fprintf(stderr, "fuzz816: cannot load %s\n", path);
+            std::exit(1);
+        }
+        image = true;
+
+        emu816::reset(false);
+        emu816::setMarker(env("FUZZ816_MARKER", 0x42), ~0UL);
+        emu816::run(~0UL, 1000000000UL);
+
+        if (emu816::getStopReason() != StopReason::MARKER) {
+            std::fprintf(stderr, "fuzz816: boot did not reach the marker\n");
+            std::exit(1);
+        }
+        emu816::resume();
+    }
+    else {
+        // Every vector leads to STP
+        memory[HALT] = 0xDB;
+        for (uint32_t vector = 0xFFE4; vector < 0x10000; vector += 2) {
+            memory[vector + 0] = HALT & 0xFF;
+            memory[vector + 1] = HALT >> 8;
+        }
+        memory[0xFFFC] = CODE & 0xFF;
+        memory[0xFFFD] = CODE >> 8;
+
+        emu816::reset(false);
+    }
+
+    emu816::snapshot();
+    return 0;
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    if (image) {
+        if (size > 0xFFFF)
+            size = 0xFFFF;
+
+        emu816::setByte(input + 0, size & 0xFF);
+        emu816::setByte(input + 1, size >> 8);
+        for (size_t i = 0; i < size; i++)
+            emu816::setByte(input + 2 + i, data[i]);
+    }
+    else {
+        if (size > CODE_END - CODE)
+            size = CODE_END - CODE;
+
+        for (size_t i = 0; i < size; i++)
+            emu816::setByte(CODE + i, data[i]);
+    }
+
+    // Run until the guest stops for anything but an interrupt wait
+    unsigned long limit = emu816::getCycles() + cycles;
+
+    while (emu816::getCycles() < limit) {
+        emu816::run(~0UL, limit);
+
+        if (!emu816::isStopped() || emu816::getStopReason() != StopReason::WAIT_INTERRUPT)
+            break;
+
+        emu816::resume();
+        emu816::interrupt();
+    }
+
+    emu816::rollback();
+    return 0;
+}
+
+#ifdef FUZZ816_MAIN
+#include <chrono>
+#include <vector>
+
+int main(int argc, char **argv) {
+    LLVMFuzzerInitialize(&argc, &argv);
+
+    std::vector<std::vector<uint8_t>> inputs;
+
+    for (int i = 1; i < argc; i++) {
+        FILE *file = std::fopen(argv[i], "rb");
+        std::vector<uint8_t> data;
+
+        if (file == NULL) {
+            std::fprintf(stderr, "fuzz816: cannot read %s\n", argv[i]);
+            continue;
+        }
+
+        int c;
+        while ((c = std::fgetc(file)) != EOF)
+            data.push_back(c);
+        std::fclose(file);
+
+        inputs.push_back(data);
+    }
+
+    unsigned long runs = env("FUZZ816_RUNS", 1);
+    auto start = std::chrono::steady_clock::now();
+
+    for (unsigned long run = 0; run < runs; run++)
+        for (const std::vector<uint8_t> &data : inputs)
+            LLVMFuzzerTestOneInput(data.data(), data.size());
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::printf("%lu executions in %.3f s, %.0f exec/s\n",
+                runs * inputs.size(), seconds, runs * inputs.size() / seconds);
+    return 0;
+}
+#endif
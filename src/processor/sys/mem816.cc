@@ -25,6 +25,64 @@
 
 #include "mem816.h"
 
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+mem816::Page			mem816::pages[PAGES];
+mem816::Page			mem816::real[REAL_PAGES];
+mem816::Addr			mem816::frames[PAGES];
+mem816::Byte			mem816::rights[PAGES];
+mem816::Device			mem816::devices[DEVICES];
+int						mem816::device_count;
+
+bool					mem816::tracking;
+mem816::Byte		   *mem816::originals[REAL_PAGES];
+mem816::Byte		   *mem816::restores[REAL_PAGES];
+mem816::Word			mem816::dirty[REAL_PAGES];
+unsigned int			mem816::dirty_count;
+mem816::Word			mem816::armed[PAGES];
+unsigned int			mem816::armed_count;
+mem816::Addr			mem816::snapshot_frames[PAGES];
+mem816::Byte			mem816::snapshot_rights[PAGES];
+bool					mem816::remapped;
+
+mem816::Byte			mem816::watched[REAL_PAGES];
+
+mem816::Byte			mem816::fences[REAL_PAGES];
+mem816::Word			mem816::fenced[REAL_PAGES];
+unsigned int			mem816::fenced_count;
+void				  (*mem816::fence_handler)();
+
+bool					mem816::protecting;
+bool					mem816::faulted;
+mem816::Addr			mem816::fault_addr;
+mem816::Byte			mem816::fault_type;
+
+// The MMU registers hold the CPU address (low, high, bank) and type of the
+// last fault, for an ABORT handler to read.
+static mem816::Byte readMmu(void *, mem816::Addr ea)
+{
+	switch (ea & 0x0f) {
+	case 0:	return (mem816::getFaultAddr() & 0xff);
+	case 1:	return ((mem816::getFaultAddr() >> 8) & 0xff);
+	case 2:	return ((mem816::getFaultAddr() >> 16) & 0xff);
+	case 3:	return (mem816::getFaultType());
+	default: return (0);
+	}
+}
+
+// Start with every page identity mapped and the MMU registers available to
+// memory maps
+static struct BankInit {
+	BankInit() {
+		mem816::resetBanks();
+		mem816::addDevice("MMU", readMmu, NULL, NULL);
+	}
+} bank_init;
+
 //==============================================================================
 
 // Never used.
@@ -34,3 +92,539 @@ mem816::mem816()
 // Never used.
 mem816::~mem816()
 { }
+
+// Register a device that MMIO pages can be mapped to
+int mem816::addDevice(const char *name, ReadHandler read, WriteHandler write, void *context)
+{
+	if (device_count == DEVICES)
+		return (-1);
+
+	Device &device = devices[device_count];
+
+	device.name = strdup(name);
+	device.read = read;
+	device.write = write;
+	device.context = context;
+
+	return (device_count++);
+}
+
+// Point the pages covering start..start+size at host memory, where host is
+// the host address of start
+void mem816::mapHost(Addr start, Addr size, Byte *host, bool writable)
+{
+	if (size == 0) return;
+
+	for (Addr page = start >> PAGE_BITS; page <= ((start + size - 1) >> PAGE_BITS) && page < REAL_PAGES; ++page) {
+		Byte *base = host + ((page << PAGE_BITS) - start);
+
+		real[page].read = base;
+		real[page].write = writable ? base : NULL;
+		real[page].kind = writable ? PAGE_RAM : PAGE_ROM;
+		real[page].device = 0;
+	}
+	refresh();
+}
+
+// Dispatch the pages covering start..start+size to a registered device
+bool mem816::mapDevice(Addr start, Addr size, const char *name)
+{
+	int device;
+
+	for (device = 0; device < device_count; ++device)
+		if (strcmp(devices[device].name, name) == 0)
+			break;
+
+	if (device == device_count || size == 0)
+		return (false);
+
+	for (Addr page = start >> PAGE_BITS; page <= ((start + size - 1) >> PAGE_BITS) && page < REAL_PAGES; ++page) {
+		real[page].read = NULL;
+		real[page].write = NULL;
+		real[page].kind = PAGE_MMIO;
+		real[page].device = device;
+	}
+	refresh();
+	return (true);
+}
+
+// Return the pages covering start..start+size to the fallback
+void mem816::unmap(Addr start, Addr size)
+{
+	if (size == 0) return;
+
+	for (Addr page = start >> PAGE_BITS; page <= ((start + size - 1) >> PAGE_BITS) && page < REAL_PAGES; ++page)
+		real[page] = Page();
+	refresh();
+}
+
+// Parse a number in ld65 syntax ($hex, 0xhex or decimal)
+static bool parseNumber(const std::string &text, unsigned long &value)
+{
+	char *end;
+
+	if (text.size() > 1 && text[0] == '$')
+		value = strtoul(text.c_str() + 1, &end, 16);
+	else
+		value = strtoul(text.c_str(), &end, 0);
+
+	return (!text.empty() && *end == 0);
+}
+
+// Split ld65 configuration text into tokens, dropping comments. Comments
+// starting #@ hold directives for the emulator that ld65 ignores, so only
+// their marker is dropped.
+static void tokenize(const char *text, std::string *tokens, int &count, int max)
+{
+	count = 0;
+
+	while (*text && count < max) {
+		if (text[0] == '#' && text[1] == '@') {
+			text += 2;
+		}
+		else if (*text == '#') {
+			while (*text && *text != '\n') ++text;
+		}
+		else if (isspace((unsigned char) *text)) {
+			++text;
+		}
+		else if (strchr("{}:;,=", *text)) {
+			tokens[count++] = std::string(1, *text++);
+		}
+		else if (*text == '"') {
+			const char *start = ++text;
+			while (*text && *text != '"') ++text;
+			tokens[count++] = std::string(start, text - start);
+			if (*text) ++text;
+		}
+		else {
+			const char *start = text;
+			while (*text && !isspace((unsigned char) *text) && !strchr("{}:;,=#\"", *text)) ++text;
+			tokens[count++] = std::string(start, text - start);
+		}
+	}
+}
+
+// An area of a MEMORY or DEVICES block
+struct Area {
+	std::string name, type, device;
+	unsigned long start, length;
+};
+
+// Parse the areas of a block, NAME: attr = value, ... ; each. Returns 1, 0
+// if there is no such block or -1 on a syntax error.
+static int parseBlock(const std::string *tokens, int count, const char *block, std::vector<Area> &areas)
+{
+	int i = 0;
+
+	while (i < count && !(tokens[i] == block && i + 1 < count && tokens[i + 1] == "{"))
+		++i;
+	if (i == count)
+		return (0);
+
+	for (i += 2; i < count && tokens[i] != "}"; ) {
+		if (i + 1 >= count || tokens[i + 1] != ":")
+			return (-1);
+
+		Area area = { tokens[i], "rw", "", 0, 0 };
+		bool has_start = false, has_size = false;
+
+		for (i += 2; i < count && tokens[i] != ";"; ) {
+			if (tokens[i] == ",") {
+				++i;
+				continue;
+			}
+			if (i + 2 >= count || tokens[i + 1] != "=")
+				break;
+
+			const std::string &key = tokens[i], &value = tokens[i + 2];
+
+			if (key == "start")
+				has_start = parseNumber(value, area.start);
+			else if (key == "size")
+				has_size = parseNumber(value, area.length);
+			else if (key == "type")
+				area.type = value;
+			else if (key == "device")
+				area.device = value;
+			i += 3;
+		}
+		if (i == count || !has_start || !has_size)
+			return (-1);
+		++i;
+
+		areas.push_back(area);
+	}
+	return (1);
+}
+
+// Configure the region table from the MEMORY block of an ld65 style map and
+// the DEVICES block of its #@ directives
+int mem816::loadMap(const char *text, Byte *memory, Addr size)
+{
+	static const int MAX_TOKENS = 4096;
+	static const unsigned long LIMIT = (unsigned long) REAL_PAGES << PAGE_BITS;
+	std::string *tokens = new std::string[MAX_TOKENS];
+	std::vector<Area> areas, devices;
+	int count, mapped = 0;
+
+	tokenize(text, tokens, count, MAX_TOKENS);
+
+	int found = parseBlock(tokens, count, "MEMORY", areas);
+
+	if (found != 1 || parseBlock(tokens, count, "DEVICES", devices) < 0) {
+		delete[] tokens;
+		return (-1);
+	}
+	delete[] tokens;
+
+	for (const Area &area : areas) {
+		// Clip to real memory
+		unsigned long length = area.length;
+
+		if (area.start >= LIMIT) continue;
+		if (area.start + length > LIMIT)
+			length = LIMIT - area.start;
+
+		if (area.start + length <= size) {
+			mapHost(area.start, length, memory + area.start, area.type != "ro");
+			++mapped;
+		}
+	}
+
+	// Devices go over the memory areas they share pages with
+	for (const Area &area : devices) {
+		if (area.start < LIMIT
+			&& mapDevice(area.start, area.length, area.device.empty() ? area.name.c_str() : area.device.c_str()))
+			++mapped;
+	}
+
+	return (mapped);
+}
+
+// Return every CPU page to the real page with the same number
+void mem816::resetBanks()
+{
+	for (int v = 0; v < PAGES; ++v) {
+		frames[v] = v;
+		rights[v] = MMU_ALL;
+	}
+	protecting = false;
+	faulted = false;
+	refresh();
+}
+
+// Copy the real page a CPU page is mapped to, dropping the host pointers its
+// rights do not allow so those accesses reach the slow path
+void mem816::refreshPage(Word virt)
+{
+	Page &page = pages[virt];
+
+	if (frames[virt] < REAL_PAGES)
+		page = real[frames[virt]];
+	else
+		page = Page();
+
+	if (!(rights[virt] & MMU_READ))
+		page.read = NULL;
+	if (!(rights[virt] & MMU_WRITE))
+		page.write = NULL;
+	page.access = rights[virt];
+
+	// Catch the first write to a clean watched page
+	if (frames[virt] < REAL_PAGES && watched[frames[virt]] == WATCH_CLEAN)
+		page.write = NULL;
+
+	// Keep the CPU off pages in use by a transfer
+	if (fenced_count != 0 && frames[virt] < REAL_PAGES && fences[frames[virt]]) {
+		page.write = NULL;
+		if (fences[frames[virt]] == FENCE_ALL)
+			page.read = NULL;
+	}
+
+	// Send writes to the slow path until the original has been saved
+	if (tracking && page.write != NULL && frames[virt] < REAL_PAGES && originals[frames[virt]] == NULL)
+		page.write = NULL;
+}
+
+// Copy the real pages of every CPU page
+void mem816::refresh()
+{
+	for (int v = 0; v < PAGES; ++v)
+		refreshPage(v);
+}
+
+// Watch the real pages of a range, starting dirty
+void mem816::watch(Addr start, Addr size)
+{
+	if (size == 0) return;
+
+	for (Addr page = start >> PAGE_BITS; page <= ((start + size - 1) >> PAGE_BITS) && page < REAL_PAGES; ++page)
+		watched[page] = WATCH_DIRTY;
+}
+
+// Collect the watched pages written since the last call and send the next
+// write to each back to the slow path
+void mem816::takeDirty(Addr start, Addr size, uint64_t *bits)
+{
+	bool cleaned = false;
+
+	if (size == 0) return;
+
+	for (Addr page = start >> PAGE_BITS; page <= ((start + size - 1) >> PAGE_BITS) && page < REAL_PAGES; ++page) {
+		Addr i = page - (start >> PAGE_BITS);
+
+		if (i % 64 == 0)
+			bits[i / 64] = 0;
+
+		if (watched[page] == WATCH_DIRTY) {
+			bits[i / 64] |= (uint64_t) 1 << (i % 64);
+			watched[page] = WATCH_CLEAN;
+			cleaned = true;
+		}
+	}
+
+	if (cleaned)
+		refresh();
+}
+
+// Fence the real page of a real address, from the next refresh()
+void mem816::fence(unsigned long ea, bool all)
+{
+	Addr page = ea >> PAGE_BITS;
+
+	if (page >= REAL_PAGES)
+		return;
+
+	if (!fences[page])
+		fenced[fenced_count++] = page;
+	if (all || !fences[page])
+		fences[page] = all ? FENCE_ALL : FENCE_WRITE;
+}
+
+// Lift every fence and let the CPU pages take the fast path again
+void mem816::unfence()
+{
+	if (fenced_count == 0)
+		return;
+
+	for (unsigned int i = 0; i < fenced_count; ++i)
+		fences[fenced[i]] = 0;
+	fenced_count = 0;
+	refresh();
+}
+
+// Start tracking writes against the current contents of memory
+void mem816::snapshotMemory()
+{
+	for (unsigned int i = 0; i < dirty_count; ++i) {
+		free(originals[dirty[i]]);
+		originals[dirty[i]] = NULL;
+	}
+	dirty_count = 0;
+	armed_count = 0;
+
+	std::memcpy(snapshot_frames, frames, sizeof(frames));
+	std::memcpy(snapshot_rights, rights, sizeof(rights));
+	remapped = false;
+
+	tracking = true;
+	refresh();
+}
+
+// Copy back the pages written since the snapshot and send the CPU pages
+// whose writes went untracked back to the slow path, so the cost is in
+// proportion to the pages written. Pages go back to the host memory they
+// were saved from, which a real page remapped since no longer points to.
+unsigned int mem816::rollbackMemory()
+{
+	unsigned int count = dirty_count;
+
+	for (unsigned int i = 0; i < dirty_count; ++i) {
+		Word page = dirty[i];
+
+		std::memcpy(restores[page], originals[page], PAGE_SIZE);
+		if (watched[page] == WATCH_CLEAN)
+			watched[page] = WATCH_DIRTY;
+		free(originals[page]);
+		originals[page] = NULL;
+	}
+	dirty_count = 0;
+
+	if (remapped) {
+		std::memcpy(frames, snapshot_frames, sizeof(frames));
+		std::memcpy(rights, snapshot_rights, sizeof(rights));
+		remapped = false;
+		refresh();
+	}
+	else {
+		for (unsigned int i = 0; i < armed_count; ++i)
+			refreshPage(armed[i]);
+	}
+	armed_count = 0;
+
+	return (count);
+}
+
+// Save the pages of a real range before the host writes to it, and mark the
+// watched ones written
+void mem816::touch(Addr start, Addr size)
+{
+	if (size == 0) return;
+
+	for (Addr page = start >> PAGE_BITS; page <= ((start + size - 1) >> PAGE_BITS) && page < REAL_PAGES; ++page) {
+		if (watched[page] == WATCH_CLEAN)
+			watched[page] = WATCH_DIRTY;
+		if (tracking)
+			saveOriginal(page);
+	}
+}
+
+// Save the contents of a writable real page the first time it is written
+// after the snapshot. Returns false if it cannot be saved.
+bool mem816::saveOriginal(Addr page)
+{
+	if (page >= REAL_PAGES || real[page].write == NULL)
+		return (true);
+	if (originals[page] != NULL)
+		return (true);
+
+	Byte *copy = (Byte *) malloc(PAGE_SIZE);
+
+	if (copy == NULL)
+		return (false);
+
+	std::memcpy(copy, real[page].write, PAGE_SIZE);
+	originals[page] = copy;
+	restores[page] = real[page].write;
+	dirty[dirty_count++] = page;
+	return (true);
+}
+
+// Read a byte at a real address
+mem816::Byte mem816::readReal(unsigned long ea)
+{
+	if ((ea >> PAGE_BITS) < REAL_PAGES) {
+		const Page &page = real[ea >> PAGE_BITS];
+
+		if (page.read != NULL)
+			return (page.read[ea & PAGE_MASK]);
+
+		if (page.kind == PAGE_MMIO) {
+			const Device &device = devices[page.device];
+
+			return (device.read ? device.read(device.context, ea) : 0);
+		}
+	}
+
+	metrics::read();
+	return (readb(ea));
+}
+
+// Write a byte at a real address
+void mem816::writeReal(unsigned long ea, Byte data)
+{
+	if ((ea >> PAGE_BITS) < REAL_PAGES) {
+		const Page &page = real[ea >> PAGE_BITS];
+
+		switch (page.kind) {
+		case PAGE_RAM:
+			touch(ea, 1);
+			page.write[ea & PAGE_MASK] = data;
+			return;
+
+		case PAGE_ROM:
+			return;
+
+		case PAGE_MMIO:
+			if (devices[page.device].write)
+				devices[page.device].write(devices[page.device].context, ea, data);
+			return;
+		}
+	}
+
+	metrics::write();
+	writeb(ea, data);
+}
+
+// Read from a protected, MMIO or unmapped page
+mem816::Byte mem816::getSlow(Addr ea)
+{
+	if (settleFence(ea))
+		return (getByte(ea));
+
+	const Page &page = pages[(ea >> PAGE_BITS) & (PAGES - 1)];
+
+	if (!(page.access & MMU_READ)) {
+		fault(ea, MMU_READ);
+		return (0);
+	}
+
+	if (page.kind == PAGE_MMIO) {
+		const Device &device = devices[page.device];
+
+		return (device.read ? device.read(device.context, translate(ea)) : 0);
+	}
+
+	metrics::read();
+	return (readb(translate(ea)));
+}
+
+// Write to a protected, ROM, MMIO or unmapped page
+void mem816::setSlow(Addr ea, Byte data)
+{
+	if (settleFence(ea)) {
+		setByte(ea, data);
+		return;
+	}
+
+	// Mark a watched page and let later writes take the fast path
+	Word virt = (ea >> PAGE_BITS) & (PAGES - 1);
+
+	if (frames[virt] < REAL_PAGES && watched[frames[virt]]) {
+		watched[frames[virt]] = WATCH_DIRTY;
+		refreshPage(virt);
+
+		if (pages[virt].write != NULL) {
+			pages[virt].write[ea & PAGE_MASK] = data;
+			return;
+		}
+	}
+
+	const Page &page = pages[(ea >> PAGE_BITS) & (PAGES - 1)];
+
+	if (!(page.access & MMU_WRITE)) {
+		fault(ea, MMU_WRITE);
+		return;
+	}
+
+	// The first write to a tracked RAM page saves it, then writes to the
+	// page take the fast path again
+	if (page.kind == PAGE_RAM && tracking) {
+		if (!saveOriginal(frames[virt]))
+			return;
+		refreshPage(virt);
+
+		if (armed_count < PAGES)
+			armed[armed_count++] = virt;
+		else
+			remapped = true;
+
+		pages[virt].write[ea & PAGE_MASK] = data;
+		return;
+	}
+
+	switch (page.kind) {
+	case PAGE_ROM:
+		break;
+
+	case PAGE_MMIO:
+		if (devices[page.device].write)
+			devices[page.device].write(devices[page.device].context, translate(ea), data);
+		break;
+
+	default:
+		metrics::write();
+		writeb(translate(ea), data);
+	}
+}
@@ -29,18 +29,76 @@
 #include "wdc816.h"
 
 #include "ffi.hpp"
+#include "metrics.hpp"
+
+// Kinds of page in the memory region table.
+enum PageKind {
+	PAGE_UNMAPPED,			// Handled by the readb/writeb fallback
+	PAGE_RAM,				// Direct host memory
+	PAGE_ROM,				// Direct host memory, writes are ignored
+	PAGE_MMIO				// Dispatched to a registered device
+};
+
+// Access rights of a CPU page, also used as the fault type.
+enum PageAccess {
+	MMU_READ = 1,
+	MMU_WRITE = 2,
+	MMU_EXEC = 4,
+	MMU_ALL = MMU_READ | MMU_WRITE | MMU_EXEC
+};
+
+// State of a real page whose writes are watched.
+enum WatchState {
+	WATCH_CLEAN = 1,		// Not written since the last takeDirty()
+	WATCH_DIRTY = 2
+};
+
+// Access kept from the CPU on a real page in use by a DMA transfer.
+enum FenceKind {
+	FENCE_WRITE = 1,
+	FENCE_ALL = 2
+};
 
 // The mem816 class defines a set of standard methods for defining and accessing
 // the emulated memory area.
+//
+// Real (physical) memory is divided into 4K pages described by a region
+// table. RAM and ROM pages hold a host pointer that is used directly, MMIO
+// pages dispatch to the handlers of a registered device and unmapped pages go
+// to the readb/writeb fallback with the real address.
+//
+// The CPU address space is translated a page at a time. Each of the 4096 CPU
+// pages has a real page and a set of access rights. The pages the CPU
+// accesses are a copy of the real page they are mapped to with the host
+// pointers the rights do not allow cleared, so they act as a software TLB
+// covering the whole 24-bit space: translation and protection cost nothing on
+// the access path and a remap only refreshes the entries it changes. An access
+// the rights do not allow records a fault that the CPU turns into an ABORT.
 
 class mem816 :
 	public wdc816
 {
 public:
+	typedef Byte (*ReadHandler)(void *context, Addr ea);
+	typedef void (*WriteHandler)(void *context, Addr ea, Byte data);
+
+	static const int	PAGE_BITS = 12;
+	static const Addr	PAGE_SIZE = 1 << PAGE_BITS;
+	static const Addr	PAGE_MASK = PAGE_SIZE - 1;
+	static const int	PAGES = 1 << (24 - PAGE_BITS);
+	static const int	BANK_PAGES = 1 << (16 - PAGE_BITS);
+	static const int	REAL_BANKS = 4096;
+	static const int	REAL_PAGES = REAL_BANKS * BANK_PAGES;
+	static const int	DEVICES = 16;
+
 	// Fetch a byte from memory.
 	INLINE static Byte getByte(Addr ea)
 	{
-		return readb(ea);
+		Byte *host = pages[(ea >> PAGE_BITS) & (PAGES - 1)].read;
+
+		if (host != NULL)
+			return (host[ea & PAGE_MASK]);
+		return (getSlow(ea));
 	}
 
 	// Fetch a word from memory
@@ -58,7 +116,12 @@ public:
 	// Write a byte to memory
 	INLINE static void setByte(Addr ea, Byte data)
 	{
-		writeb(ea, data);
+		Byte *host = pages[(ea >> PAGE_BITS) & (PAGES - 1)].write;
+
+		if (host != NULL)
+			host[ea & PAGE_MASK] = data;
+		else
+			setSlow(ea, data);
 	}
 
 	// Write a word to memory
@@ -68,7 +131,183 @@ public:
 		setByte(ea + 1, hi(data));
 	}
 
+	// Register a device for MMIO regions and return its number, or -1 if
+	// the device table is full.
+	static int addDevice(const char *name, ReadHandler read, WriteHandler write, void *context);
+
+	// Map a range of real pages to host memory, to a device or back to the
+	// fallback. Ranges are rounded out to whole pages.
+	static void mapHost(Addr start, Addr size, Byte *host, bool writable);
+	static bool mapDevice(Addr start, Addr size, const char *name);
+	static void unmap(Addr start, Addr size);
+
+	// Configure the region table from the MEMORY block of a memory map in
+	// ld65 configuration syntax. Areas of type rw (the default) and ro are
+	// backed directly by memory at the same offset. Device registers are
+	// placed by a DEVICES block written in #@ comments, which ld65 ignores:
+	//
+	//	#@ DEVICES {
+	//	#@     PPU: start = $F00000, size = $1000;
+	//	#@ }
+	//
+	// Each area is dispatched to the device named by its device attribute,
+	// or by the area name. Returns the number of areas mapped, or -1 on a
+	// syntax error.
+	static int loadMap(const char *text, Byte *memory, Addr size);
+
+	// Map a CPU page to a real page with the given access rights.
+	INLINE static void mapPage(Word virt, Addr real, Byte access)
+	{
+		virt &= PAGES - 1;
+		remapped = true;
+		frames[virt] = real;
+		rights[virt] = access;
+		if (access != MMU_ALL)
+			protecting = true;
+		refreshPage(virt);
+	}
+
+	// Map a CPU bank to a real bank with full access.
+	INLINE static void mapBank(Byte virt, Word real)
+	{
+		for (int i = 0; i < BANK_PAGES; ++i)
+			mapPage(virt * BANK_PAGES + i, (Addr) real * BANK_PAGES + i, MMU_ALL);
+	}
+
+	// Return every CPU page to the real page with the same number.
+	static void resetBanks();
+
+	// Translate a CPU address to a real address.
+	INLINE static unsigned long translate(Addr ea)
+	{
+		return ((frames[(ea >> PAGE_BITS) & (PAGES - 1)] << PAGE_BITS) | (ea & PAGE_MASK));
+	}
+
+	// Test if an instruction may be fetched from a CPU address.
+	INLINE static bool canExecute(Addr ea)
+	{
+		return (pages[(ea >> PAGE_BITS) & (PAGES - 1)].access & MMU_EXEC);
+	}
+
+	// Start tracking writes to RAM pages against a snapshot of memory. The
+	// first write to each page after this, or after a rollback, saves its
+	// contents.
+	static void snapshotMemory();
+
+	// Restore the pages written since the snapshot or the last rollback and
+	// return how many there were. Device state is not restored.
+	static unsigned int rollbackMemory();
+
+	// Save the pages of a real range about to be written by the host, so the
+	// next rollback restores them too, and mark the watched ones written.
+	static void touch(Addr start, Addr size);
+
+	// Watch the real pages of a range for writes, by the CPU or a transfer.
+	// The first write to a page after it is collected takes the slow path to
+	// mark it, later ones the fast path. Pages start dirty.
+	static void watch(Addr start, Addr size);
+
+	// Set a bit in bits for each page of a watched range written since the
+	// last call, page 0 in bit 0 of bits[0], and mark them clean.
+	static void takeDirty(Addr start, Addr size, uint64_t *bits);
+
+	// Read or write a byte at a real address the way the CPU would, for
+	// pages without host memory.
+	static Byte readReal(unsigned long ea);
+	static void writeReal(unsigned long ea, Byte data);
+
+	// Return the CPU address and type of the last fault.
+	INLINE static Addr getFaultAddr()
+	{
+		return (fault_addr);
+	}
+
+	INLINE static Byte getFaultType()
+	{
+		return (fault_type);
+	}
+
 protected:
+	struct Page {
+		Byte	   *read;			// Host page for reads, or NULL
+		Byte	   *write;			// Host page for writes, or NULL
+		Byte		kind;
+		Byte		device;
+		Byte		access;			// Rights of the CPU page
+	};
+
+	struct Device {
+		const char	   *name;
+		ReadHandler		read;
+		WriteHandler	write;
+		void		   *context;
+	};
+
+	static Page		pages[PAGES];			// CPU pages, copied from real
+	static Page		real[REAL_PAGES];		// Real pages
+	static Addr		frames[PAGES];			// Real page of each CPU page
+	static Byte		rights[PAGES];			// Access rights of each CPU page
+	static Device	devices[DEVICES];
+	static int		device_count;
+
+	static bool		tracking;				// Writes are tracked for rollback
+	static Byte	   *originals[REAL_PAGES];	// Saved contents of each real page
+	static Byte	   *restores[REAL_PAGES];	// Host memory each was saved from
+	static Word		dirty[REAL_PAGES];		// Real pages written since the snapshot
+	static unsigned int	dirty_count;
+	static Word		armed[PAGES];			// CPU pages whose writes are no longer tracked
+	static unsigned int	armed_count;
+	static Addr		snapshot_frames[PAGES];	// Page table at the snapshot
+	static Byte		snapshot_rights[PAGES];
+	static bool		remapped;				// Page table changed since the snapshot
+
+	static Byte		watched[REAL_PAGES];	// WatchState of each real page
+
+	static Byte		fences[REAL_PAGES];		// Real pages in use by a transfer
+	static Word		fenced[REAL_PAGES];
+	static unsigned int	fenced_count;
+
+	static bool		protecting;				// Some page has restricted rights
+	static bool		faulted;				// An access was refused
+	static Addr		fault_addr;
+	static Byte		fault_type;
+
+	// Wait for the transfer using a fenced page
+	INLINE static bool settleFence(Addr ea)
+	{
+		Addr frame = frames[(ea >> PAGE_BITS) & (PAGES - 1)];
+
+		if (fenced_count == 0 || frame >= REAL_PAGES || !fences[frame])
+			return (false);
+		fence_handler();
+		return (true);
+	}
+
+	static Byte getSlow(Addr ea);
+	static void setSlow(Addr ea, Byte data);
+
+	// Record a refused access for the CPU to raise an ABORT
+	INLINE static void fault(Addr ea, Byte type)
+	{
+		faulted = true;
+		fault_addr = ea & 0xffffff;
+		fault_type = type;
+	}
+
+	// Keep the CPU off the real page holding a real address while a DMA
+	// transfer on another thread uses it. From the next refresh() writes, or
+	// with all set every access, go to the slow path, which calls
+	// fence_handler to wait for the transfer; it must lift the fences with
+	// unfence().
+	static void fence(unsigned long ea, bool all);
+	static void unfence();
+
+	static void (*fence_handler)();
+
+	static void refreshPage(Word virt);
+	static void refresh();
+	static bool saveOriginal(Addr page);
+
 	mem816();
 	~mem816();
 };
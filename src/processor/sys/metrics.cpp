@@ -0,0 +1,79 @@
+#include "metrics.hpp"
+
+#include <chrono>
+
+std::atomic<uint64_t> metrics::instructions;
+std::atomic<uint64_t> metrics::cycles;
+std::atomic<uint64_t> metrics::stops[STOP_REASONS];
+std::atomic<uint64_t> metrics::cop_requests[256];
+std::atomic<uint64_t> metrics::interrupts;
+std::atomic<uint64_t> metrics::running_ns;
+std::atomic<uint64_t> metrics::stopped_ns;
+std::atomic<uint64_t> metrics::memory_reads;
+std::atomic<uint64_t> metrics::memory_writes;
+std::atomic<uint64_t> metrics::since;
+std::atomic<bool> metrics::running;
+
+static uint64_t now() {
+    using namespace std::chrono;
+
+    return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+// Close the current interval into the running or stopped total and start a
+// new one in the given state.
+static void transition(std::atomic<uint64_t> &since, std::atomic<bool> &running,
+                       std::atomic<uint64_t> &running_ns, std::atomic<uint64_t> &stopped_ns,
+                       bool next) {
+    uint64_t time = now();
+    uint64_t last = since.load(std::memory_order_relaxed);
+
+    if (last != 0) {
+        std::atomic<uint64_t> &total = running.load(std::memory_order_relaxed) ? running_ns : stopped_ns;
+        total.store(total.load(std::memory_order_relaxed) + (time - last), std::memory_order_relaxed);
+    }
+
+    running.store(next, std::memory_order_relaxed);
+    since.store(time, std::memory_order_relaxed);
+}
+
+void metrics::stop(int reason) {
+    if (reason >= 0 && reason < STOP_REASONS)
+        bump(stops[reason]);
+
+    transition(since, running, running_ns, stopped_ns, false);
+}
+
+void metrics::resume() {
+    transition(since, running, running_ns, stopped_ns, true);
+}
+
+void metrics::snapshot(MetricsSnapshot *dest) {
+    dest->instructions = instructions.load(std::memory_order_relaxed);
+    dest->cycles = cycles.load(std::memory_order_relaxed);
+
+    for (int i = 0; i < STOP_REASONS; i++)
+        dest->stops[i] = stops[i].load(std::memory_order_relaxed);
+
+    for (int i = 0; i < 256; i++)
+        dest->cop_requests[i] = cop_requests[i].load(std::memory_order_relaxed);
+
+    dest->interrupts = interrupts.load(std::memory_order_relaxed);
+    dest->running_ns = running_ns.load(std::memory_order_relaxed);
+    dest->stopped_ns = stopped_ns.load(std::memory_order_relaxed);
+    dest->memory_reads = memory_reads.load(std::memory_order_relaxed);
+    dest->memory_writes = memory_writes.load(std::memory_order_relaxed);
+
+    // Include the interval in progress so a CPU stuck in one state shows up
+    uint64_t last = since.load(std::memory_order_relaxed);
+    if (last != 0) {
+        uint64_t time = now();
+
+        if (time > last) {
+            if (running.load(std::memory_order_relaxed))
+                dest->running_ns += time - last;
+            else
+                dest->stopped_ns += time - last;
+        }
+    }
+}
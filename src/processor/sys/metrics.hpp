@@ -0,0 +1,76 @@
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include <stdint.h>
+#include <atomic>
+
+// Number of StopReason values, including RUNNING.
+#define STOP_REASONS 5
+
+// A copy of the runtime metrics, laid out for sharing over the FFI.
+struct MetricsSnapshot {
+    uint64_t instructions;
+    uint64_t cycles;
+    uint64_t stops[STOP_REASONS];
+    uint64_t cop_requests[256];
+    uint64_t interrupts;
+    uint64_t running_ns;
+    uint64_t stopped_ns;
+    uint64_t memory_reads;
+    uint64_t memory_writes;
+};
+
+// Runtime counters for the emulated CPU.
+//
+// Only the CPU thread writes the counters, so updates are a relaxed load and
+// store rather than a locked read-modify-write. Any thread may take a
+// snapshot at any time without pausing the CPU.
+class metrics {
+public:
+    static void retire(unsigned long cycles) {
+        bump(instructions);
+        metrics::cycles.store(cycles, std::memory_order_relaxed);
+    }
+
+    static void read() {
+        bump(memory_reads);
+    }
+
+    static void write() {
+        bump(memory_writes);
+    }
+
+    static void cop(uint8_t opcode) {
+        bump(cop_requests[opcode]);
+    }
+
+    static void interrupt() {
+        bump(interrupts);
+    }
+
+    static void stop(int reason);
+    static void resume();
+
+    static void snapshot(MetricsSnapshot *dest);
+
+private:
+    static void bump(std::atomic<uint64_t> &counter) {
+        counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    static std::atomic<uint64_t> instructions;
+    static std::atomic<uint64_t> cycles;
+    static std::atomic<uint64_t> stops[STOP_REASONS];
+    static std::atomic<uint64_t> cop_requests[256];
+    static std::atomic<uint64_t> interrupts;
+    static std::atomic<uint64_t> running_ns;
+    static std::atomic<uint64_t> stopped_ns;
+    static std::atomic<uint64_t> memory_reads;
+    static std::atomic<uint64_t> memory_writes;
+
+    // Host time of the last stop/resume transition and the state entered
+    static std::atomic<uint64_t> since;
+    static std::atomic<bool> running;
+};
+
+#endif /* METRICS_HPP */
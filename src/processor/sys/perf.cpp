@@ -0,0 +1,117 @@
+#include "perf.hpp"
+
+#include <chrono>
+#include <cstring>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+int perf::leader = -1;
+int perf::members[3] = { -1, -1, -1 };
+uint64_t perf::started;
+PerfCounters perf::totals;
+
+static uint64_t now() {
+    using namespace std::chrono;
+
+    return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+#ifdef __linux__
+static int openEvent(uint64_t config, int group) {
+    struct perf_event_attr attr;
+
+    std::memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = config;
+    attr.disabled = group < 0 ? 1 : 0;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+
+    return (int) syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+#endif
+
+// Open the counter group on the calling thread. Counters follow the thread
+// that opened them, so this must be called from the CPU thread.
+bool perf::open() {
+#ifdef __linux__
+    static const uint64_t configs[3] = {
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_BRANCH_MISSES,
+        PERF_COUNT_HW_CACHE_MISSES
+    };
+
+    close();
+
+    leader = openEvent(PERF_COUNT_HW_CPU_CYCLES, -1);
+    if (leader < 0)
+        return false;
+
+    for (int i = 0; i < 3; i++) {
+        members[i] = openEvent(configs[i], leader);
+        if (members[i] < 0) {
+            close();
+            return false;
+        }
+    }
+
+    return true;
+#else
+    return false;
+#endif
+}
+
+void perf::close() {
+#ifdef __linux__
+    for (int i = 0; i < 3; i++) {
+        if (members[i] >= 0)
+            ::close(members[i]);
+        members[i] = -1;
+    }
+
+    if (leader >= 0)
+        ::close(leader);
+#endif
+    leader = -1;
+}
+
+void perf::begin() {
+#ifdef __linux__
+    if (leader >= 0)
+        ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+#endif
+    started = now();
+}
+
+void perf::end(uint64_t instructions, uint64_t cycles) {
+    totals.nanoseconds += now() - started;
+    totals.guest_instructions += instructions;
+    totals.guest_cycles += cycles;
+
+#ifdef __linux__
+    if (leader >= 0) {
+        // PERF_FORMAT_GROUP: { nr, values[nr] } in creation order
+        uint64_t values[1 + 4];
+
+        ioctl(leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+        if (read(leader, values, sizeof(values)) == sizeof(values)) {
+            totals.host_cycles += values[1];
+            totals.host_instructions += values[2];
+            totals.branch_misses += values[3];
+            totals.cache_misses += values[4];
+        }
+        ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    }
+#endif
+}
+
+void perf::get(PerfCounters *dest) {
+    *dest = totals;
+}
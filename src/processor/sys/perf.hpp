@@ -0,0 +1,42 @@
+#ifndef PERF_HPP
+#define PERF_HPP
+
+#include <stdint.h>
+
+// Host hardware counters accumulated over batched interpreter runs, laid out
+// for sharing over the FFI.
+struct PerfCounters {
+    uint64_t host_cycles;
+    uint64_t host_instructions;
+    uint64_t branch_misses;
+    uint64_t cache_misses;
+    uint64_t guest_instructions;
+    uint64_t guest_cycles;
+    uint64_t nanoseconds;
+};
+
+// Optional instrumentation around emu816::run() using Linux perf_event_open.
+// On other hosts, or when the kernel refuses the events, open() fails and the
+// wrapper only keeps guest and wall clock totals.
+class perf {
+public:
+    static bool open();
+    static void close();
+
+    static bool isOpen() {
+        return (leader >= 0);
+    }
+
+    static void begin();
+    static void end(uint64_t instructions, uint64_t cycles);
+
+    static void get(PerfCounters *dest);
+
+private:
+    static int leader;
+    static int members[3];
+    static uint64_t started;
+    static PerfCounters totals;
+};
+
+#endif /* PERF_HPP */
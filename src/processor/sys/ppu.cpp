@@ -0,0 +1,289 @@
+#include "ppu.hpp"
+#include "dma.hpp"
+
+#include <cstring>
+#include <stdint.h>
+
+static const int TILES = 4096;
+static const int TILE_BYTES = ppu::TILE_SIZE * ppu::TILE_SIZE;
+static const int MAP_LOG_MAX = 7;
+static const int SPRITE_BYTES = 8;
+
+// Ranks of the layers' pixels, back to front. A pixel shows the highest.
+enum Rank {
+    RANK_NONE,
+    RANK_LAYER1,
+    RANK_LAYER0,
+    RANK_SPRITE,
+    RANK_LAYER1_HIGH,
+    RANK_LAYER0_HIGH,
+    RANK_SPRITE_HIGH
+};
+
+enum MapEntry {
+    ENTRY_TILE = 0x0fff,
+    ENTRY_FLIP_X = 0x1000,
+    ENTRY_FLIP_Y = 0x2000,
+    ENTRY_HIGH = 0x4000
+};
+
+enum SpriteFlags {
+    SPRITE_FLIP_X = 0x01,
+    SPRITE_FLIP_Y = 0x02,
+    SPRITE_HIGH = 0x04,
+    SPRITE_HIDDEN = 0x80
+};
+
+mem816::Byte ppu::regs[PPU_REGISTERS];
+
+// Copies of tables not in contiguous host memory
+static uint8_t tile_scratch[ppu::LAYERS + 1][TILES * TILE_BYTES];
+static uint8_t map_scratch[ppu::LAYERS][2 << (2 * MAP_LOG_MAX)];
+static uint8_t sprite_scratch[256 * SPRITE_BYTES];
+static uint8_t palette_scratch[512];
+
+// The registers, available to memory maps
+static struct PpuInit {
+    PpuInit() {
+        ppu::reset();
+        mem816::addDevice("PPU", ppu::read, ppu::write, NULL);
+    }
+} ppu_init;
+
+void ppu::reset() {
+    std::memset(regs, 0, sizeof(regs));
+
+    regs[PPU_TARGET + 2] = 0x0a;
+    regs[PPU_TARGET_PITCH + 1] = 2048 >> 8;
+    regs[PPU_WIDTH + 1] = 1024 >> 8;
+    regs[PPU_HEIGHT] = 720 & 0xff;
+    regs[PPU_HEIGHT + 1] = 720 >> 8;
+}
+
+mem816::Byte ppu::read(void *, Addr ea) {
+    return regs[ea & (PPU_REGISTERS - 1)];
+}
+
+void ppu::write(void *, Addr ea, Byte data) {
+    int offset = ea & (PPU_REGISTERS - 1);
+
+    if (offset != PPU_FRAME && offset != PPU_FRAME + 1)
+        regs[offset] = data;
+}
+
+unsigned long ppu::reg16(int offset) {
+    return regs[offset] | (unsigned long) regs[offset + 1] << 8;
+}
+
+unsigned long ppu::reg32(int offset) {
+    return reg16(offset) | reg16(offset + 2) << 16;
+}
+
+// Return the host memory of length bytes of real memory, or NULL if it is not
+// all contiguous host memory
+mem816::Byte *ppu::hostRun(unsigned long addr, unsigned long length, bool write) {
+    unsigned long first = addr >> PAGE_BITS;
+    unsigned long last = (addr + length - 1) >> PAGE_BITS;
+
+    if (last >= (unsigned long) REAL_PAGES)
+        return NULL;
+
+    Byte *base = write ? real[first].write : real[first].read;
+
+    if (base == NULL)
+        return NULL;
+
+    for (unsigned long page = first + 1; page <= last; ++page)
+        if ((write ? real[page].write : real[page].read) != base + ((page - first) << PAGE_BITS))
+            return NULL;
+    return base + (addr & PAGE_MASK);
+}
+
+// Return a table in host memory, copying it to scratch if it is not
+const mem816::Byte *ppu::fetch(unsigned long addr, unsigned long length, Byte *scratch) {
+    const Byte *host = hostRun(addr, length, false);
+
+    if (host != NULL)
+        return host;
+
+    // A run of host memory at a time, only MMIO and unmapped pages a byte at
+    // a time
+    dma::copyOut(addr, false, scratch, length);
+    return scratch;
+}
+
+// Draw a line of a layer, a tile row at a time
+void ppu::drawLayer(const Layer &layer, Word y, Word width, Byte low, Byte high, Byte *index, Byte *rank) {
+    unsigned long map_y = y + layer.scroll_y;
+    unsigned long tile_y = (map_y / TILE_SIZE) & ((1UL << layer.height_log) - 1);
+    unsigned long row = map_y % TILE_SIZE;
+
+    for (Word x = 0; x < width; ) {
+        unsigned long map_x = x + layer.scroll_x;
+        unsigned long tile_x = (map_x / TILE_SIZE) & ((1UL << layer.width_log) - 1);
+        const Byte *cell = layer.map + ((tile_y << layer.width_log | tile_x) << 1);
+        Word entry = cell[0] | cell[1] << 8;
+        const Byte *pixels = layer.tiles + (entry & ENTRY_TILE) * TILE_BYTES
+            + ((entry & ENTRY_FLIP_Y) ? TILE_SIZE - 1 - row : row) * TILE_SIZE;
+        Byte shown = (entry & ENTRY_HIGH) ? high : low;
+
+        for (unsigned long column = map_x % TILE_SIZE; column < TILE_SIZE && x < width; ++column, ++x) {
+            Byte pixel = pixels[(entry & ENTRY_FLIP_X) ? TILE_SIZE - 1 - column : column];
+
+            index[x] = pixel;
+            rank[x] = pixel ? shown : (Byte) RANK_NONE;
+        }
+    }
+}
+
+// Draw the sprites crossing a line, back to front
+void ppu::drawSprites(const Byte *sprites, int count, const Byte *tiles, Word y, Word width,
+                      Byte *index, Byte *rank) {
+    std::memset(rank, RANK_NONE, width);
+
+    for (int sprite = count; sprite-- > 0; ) {
+        const Byte *entry = sprites + sprite * SPRITE_BYTES;
+        int sprite_x = (int16_t) (entry[0] | entry[1] << 8);
+        int sprite_y = (int16_t) (entry[2] | entry[3] << 8);
+        Word first = entry[4] | entry[5] << 8;
+        Byte flags = entry[6];
+        int columns = (entry[7] & 7) + 1;
+        int w = columns * TILE_SIZE;
+        int h = ((entry[7] >> 3 & 7) + 1) * TILE_SIZE;
+        int line = (int) y - sprite_y;
+
+        if ((flags & SPRITE_HIDDEN) || line < 0 || line >= h)
+            continue;
+
+        if (flags & SPRITE_FLIP_Y)
+            line = h - 1 - line;
+
+        Byte shown = (flags & SPRITE_HIGH) ? RANK_SPRITE_HIGH : RANK_SPRITE;
+        int start = sprite_x < 0 ? -sprite_x : 0;
+        int end = sprite_x + w > width ? width - sprite_x : w;
+
+        for (int i = start; i < end; ++i) {
+            int column = (flags & SPRITE_FLIP_X) ? w - 1 - i : i;
+            Word tile = (first + (line / TILE_SIZE) * columns + column / TILE_SIZE) & ENTRY_TILE;
+            Byte pixel = tiles[tile * TILE_BYTES + (line % TILE_SIZE) * TILE_SIZE + column % TILE_SIZE];
+
+            if (pixel) {
+                index[sprite_x + i] = pixel;
+                rank[sprite_x + i] = shown;
+            }
+        }
+    }
+}
+
+// Write a line of output, in bulk when it is contiguous host memory
+void ppu::store(unsigned long addr, const Byte *pixels, Addr length) {
+    Byte *host = hostRun(addr, length, true);
+
+    if (host != NULL) {
+        touch(addr, length);
+        std::memcpy(host, pixels, length);
+        return;
+    }
+
+    for (Addr i = 0; i < length; ++i)
+        writeReal(addr + i, pixels[i]);
+}
+
+bool ppu::render() {
+    Byte control = regs[PPU_CONTROL];
+
+    if (!(control & PPU_ENABLE))
+        return false;
+
+    // Asynchronous transfers may still be writing the tables
+    dma::settle();
+
+    Word width = reg16(PPU_WIDTH) < MAX_WIDTH ? reg16(PPU_WIDTH) : MAX_WIDTH;
+    Word height = reg16(PPU_HEIGHT);
+    unsigned long target = reg32(PPU_TARGET);
+    unsigned long pitch = reg16(PPU_TARGET_PITCH);
+    Word backdrop = reg16(PPU_BACKDROP);
+
+    const Byte *entries = fetch(reg32(PPU_PALETTE), sizeof(palette_scratch), palette_scratch);
+    Word palette[256];
+
+    for (int i = 0; i < 256; ++i)
+        palette[i] = entries[2 * i] | entries[2 * i + 1] << 8;
+
+    Layer layers[LAYERS];
+    bool shown[LAYERS];
+
+    for (int i = 0; i < LAYERS; ++i) {
+        const Byte *block = regs + PPU_LAYERS + i * PPU_LAYER_SIZE;
+        Layer &layer = layers[i];
+
+        shown[i] = (control & (i == 0 ? PPU_LAYER0 : PPU_LAYER1)) != 0;
+        if (!shown[i])
+            continue;
+
+        layer.width_log = block[PPU_LAYER_MAP_WIDTH] < MAP_LOG_MAX ? block[PPU_LAYER_MAP_WIDTH] : MAP_LOG_MAX;
+        layer.height_log = block[PPU_LAYER_MAP_HEIGHT] < MAP_LOG_MAX ? block[PPU_LAYER_MAP_HEIGHT] : MAP_LOG_MAX;
+        layer.scroll_x = reg16(PPU_LAYERS + i * PPU_LAYER_SIZE + PPU_LAYER_SCROLL_X);
+        layer.scroll_y = reg16(PPU_LAYERS + i * PPU_LAYER_SIZE + PPU_LAYER_SCROLL_Y);
+        layer.map = fetch(reg32(PPU_LAYERS + i * PPU_LAYER_SIZE + PPU_LAYER_MAP),
+                          2UL << (layer.width_log + layer.height_log), map_scratch[i]);
+        layer.tiles = fetch(reg32(PPU_LAYERS + i * PPU_LAYER_SIZE + PPU_LAYER_TILES),
+                            sizeof(tile_scratch[i]), tile_scratch[i]);
+    }
+
+    int sprite_count = (control & PPU_SPRITES_ON) ? regs[PPU_SPRITE_COUNT] : 0;
+    const Byte *sprites = NULL;
+    const Byte *sprite_tiles = NULL;
+
+    if (sprite_count != 0) {
+        sprites = fetch(reg32(PPU_SPRITES), sprite_count * SPRITE_BYTES, sprite_scratch);
+        sprite_tiles = fetch(reg32(PPU_SPRITE_TILES), sizeof(tile_scratch[LAYERS]), tile_scratch[LAYERS]);
+    }
+
+    static Byte index[LAYERS + 1][MAX_WIDTH];
+    static Byte rank[LAYERS + 1][MAX_WIDTH];
+    static Byte line[MAX_WIDTH * 2];
+    static const Byte LOW[LAYERS] = {RANK_LAYER0, RANK_LAYER1};
+    static const Byte HIGH[LAYERS] = {RANK_LAYER0_HIGH, RANK_LAYER1_HIGH};
+
+    for (int i = 0; i <= LAYERS; ++i)
+        std::memset(rank[i], RANK_NONE, width);
+
+    for (Word y = 0; y < height; ++y) {
+        for (int i = 0; i < LAYERS; ++i)
+            if (shown[i])
+                drawLayer(layers[i], y, width, LOW[i], HIGH[i], index[i], rank[i]);
+
+        if (sprite_count != 0)
+            drawSprites(sprites, sprite_count, sprite_tiles, y, width, index[LAYERS], rank[LAYERS]);
+
+        // Pick the highest ranked pixel of each column, a straight loop the
+        // compiler vectorizes except for the palette lookup
+        for (Word x = 0; x < width; ++x) {
+            Byte best = rank[1][x];
+            Byte pixel = index[1][x];
+
+            if (rank[0][x] > best) {
+                best = rank[0][x];
+                pixel = index[0][x];
+            }
+            if (rank[LAYERS][x] > best) {
+                best = rank[LAYERS][x];
+                pixel = index[LAYERS][x];
+            }
+
+            Word color = best != RANK_NONE ? palette[pixel] : backdrop;
+
+            line[2 * x] = color & 0xff;
+            line[2 * x + 1] = color >> 8;
+        }
+
+        store(target + y * pitch, line, (Addr) width * 2);
+    }
+
+    Word frame = reg16(PPU_FRAME) + 1;
+
+    regs[PPU_FRAME] = frame & 0xff;
+    regs[PPU_FRAME + 1] = frame >> 8;
+    return true;
+}
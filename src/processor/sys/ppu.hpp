@@ -0,0 +1,100 @@
+#ifndef PPU_HPP
+#define PPU_HPP
+
+#include "mem816.h"
+
+// Tile and sprite video device, composited natively into the framebuffer once
+// per frame so the guest only maintains small tables.
+//
+// The device is a page of registers, placed by an area of a memory map's
+// DEVICES block naming device PPU. The tables it draws from are in ordinary
+// real memory at the addresses the registers give, so the guest updates them
+// at full speed:
+//
+//   tiles     8x8 pixels of 8-bit palette indices, 64 bytes each; index 0 is
+//             transparent
+//   maps      a 16-bit entry per tile, row by row: bits 0-11 tile, 12 flip
+//             horizontally, 13 flip vertically, 14 in front of sprites
+//             without priority. Maps are 2^n tiles a side and wrap.
+//   sprites   8 bytes each: x, y (signed 16-bit), first tile (16-bit), flags
+//             (bit 0 flip horizontally, 1 vertically, 2 in front of both
+//             layers, 7 hidden) and size (bits 0-2 width - 1, 3-5 height - 1,
+//             in tiles). The tiles of a sprite are consecutive, row by row.
+//             Lower numbered sprites are drawn in front.
+//   palette   256 RGB565 entries
+//
+// From back to front a pixel shows the backdrop, layer 1, layer 0, sprites,
+// then layers 1 and 0 again for tiles with priority, then sprites with
+// priority. Registers are little endian; the frame counter is read-only.
+class ppu : public mem816 {
+public:
+    enum Register {
+        PPU_CONTROL = 0x00,         // PpuControl bits
+        PPU_SPRITE_COUNT = 0x01,
+        PPU_BACKDROP = 0x02,        // RGB565
+        PPU_TARGET = 0x04,          // Real address of the output
+        PPU_TARGET_PITCH = 0x08,
+        PPU_WIDTH = 0x0a,           // Output size in pixels
+        PPU_HEIGHT = 0x0c,
+        PPU_FRAME = 0x0e,           // Frames drawn
+        PPU_PALETTE = 0x10,         // Real addresses of the tables
+        PPU_SPRITES = 0x14,
+        PPU_SPRITE_TILES = 0x18,
+        PPU_LAYERS = 0x20,          // A block of registers per layer
+
+        PPU_LAYER_MAP = 0x00,
+        PPU_LAYER_TILES = 0x04,
+        PPU_LAYER_SCROLL_X = 0x08,
+        PPU_LAYER_SCROLL_Y = 0x0a,
+        PPU_LAYER_MAP_WIDTH = 0x0c, // Log2 of the map size in tiles
+        PPU_LAYER_MAP_HEIGHT = 0x0d,
+        PPU_LAYER_SIZE = 0x10,
+
+        PPU_REGISTERS = 0x40
+    };
+
+    enum PpuControl {
+        PPU_ENABLE = 0x01,
+        PPU_LAYER0 = 0x02,
+        PPU_LAYER1 = 0x04,
+        PPU_SPRITES_ON = 0x08
+    };
+
+    static const int LAYERS = 2;
+    static const int TILE_SIZE = 8;
+    static const Word MAX_WIDTH = 2048;
+
+    // Return the registers to their power-on values: disabled, drawing a
+    // 1024x720 frame at $A0000 with a 2048 byte pitch
+    static void reset();
+
+    // Draw a frame if the device is enabled. Returns true if it drew one.
+    static bool render();
+
+    static Byte read(void *context, Addr ea);
+    static void write(void *context, Addr ea, Byte data);
+
+private:
+    // A layer's tables and position for the frame being drawn
+    struct Layer {
+        const Byte *map;
+        const Byte *tiles;
+        unsigned long scroll_x;
+        unsigned long scroll_y;
+        Byte width_log;
+        Byte height_log;
+    };
+
+    static Byte regs[PPU_REGISTERS];
+
+    static unsigned long reg16(int offset);
+    static unsigned long reg32(int offset);
+    static Byte *hostRun(unsigned long addr, unsigned long length, bool write);
+    static const Byte *fetch(unsigned long addr, unsigned long length, Byte *scratch);
+    static void drawLayer(const Layer &layer, Word y, Word width, Byte low, Byte high, Byte *index, Byte *rank);
+    static void drawSprites(const Byte *sprites, int count, const Byte *tiles, Word y, Word width,
+                            Byte *index, Byte *rank);
+    static void store(unsigned long addr, const Byte *pixels, Addr length);
+};
+
+#endif
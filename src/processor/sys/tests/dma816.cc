@@ -0,0 +1,435 @@
+// Checks of the DMA engine against straightforward reference copies.
+//
+// Real memory is host RAM except for one unmapped bank, which goes to the
+// readb/writeb fallback and so exercises the byte paths. CPU ranges are
+// checked with their pages mapped out of order, so the runs a request is
+// resolved to end at odd offsets and may alias each other.
+//
+// Exits with the number of failed checks.
+
+#include "dma.hpp"
+#include "emu816.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <vector>
+
+static const uint32_t MEMORY_SIZE = 1 << 24;
+static const uint32_t HOLE = 0x900000;          // Unmapped, to readb/writeb
+static const uint32_t HOLE_SIZE = 0x10000;
+static const uint32_t WINDOW = 0x200000;        // CPU pages mapped out of order
+static const uint32_t FRAMES = 0x300000;        // The real pages behind them
+static const int WINDOW_PAGES = 8;
+static const uint32_t WINDOW_SIZE = WINDOW_PAGES * mem816::PAGE_SIZE;
+
+static const char *MAP =
+    "MEMORY {\n"
+    "    RAM:  start = $0, size = $900000;\n"
+    "    HIGH: start = $910000, size = $6F0000;\n"
+    "}\n"
+    "#@ DEVICES { DMA: start = $FF000, size = $1000; }\n";
+
+static uint8_t *memory;
+static uint8_t hole[HOLE_SIZE];
+static int failures;
+
+extern "C" {
+    uint8_t readb(uint32_t addr) {
+        return addr >= HOLE && addr < HOLE + HOLE_SIZE ? hole[addr - HOLE] : 0;
+    }
+
+    void writeb(uint32_t addr, uint8_t data) {
+        if (addr >= HOLE && addr < HOLE + HOLE_SIZE)
+            hole[addr - HOLE] = data;
+    }
+}
+
+static void check(bool passed, const char *what) {
+    if (!passed) {
+        std::printf("FAILED: %s\n", what);
+        ++failures;
+    }
+}
+
+// Return the byte at a real address
+static uint8_t &at(unsigned long real) {
+    return real >= HOLE && real < HOLE + HOLE_SIZE ? hole[real - HOLE] : memory[real];
+}
+
+// Return the real address of a byte of a range
+static unsigned long locate(uint32_t addr, bool is_virtual) {
+    return is_virtual ? mem816::translate(addr) : addr;
+}
+
+static void pattern(unsigned long real, uint32_t size, unsigned seed) {
+    for (uint32_t i = 0; i < size; ++i)
+        at(real + i) = (uint8_t) ((i * 7 + seed) ^ (i >> 8));
+}
+
+// Map the window's pages to its frames in the given order
+static void mapWindow(const int *order) {
+    mem816::resetBanks();
+    for (int i = 0; i < WINDOW_PAGES; ++i)
+        mem816::mapPage((WINDOW >> mem816::PAGE_BITS) + i, (FRAMES >> mem816::PAGE_BITS) + order[i], MMU_ALL);
+}
+
+// Transfer and compare with a copy through a buffer, a byte at a time
+static bool transferMatches(uint32_t src, bool src_virtual, uint32_t dest, bool dest_virtual, uint32_t size) {
+    std::vector<uint8_t> buffer(size);
+    std::vector<uint8_t> expected(WINDOW_SIZE);
+
+    for (uint32_t i = 0; i < size; ++i)
+        buffer[i] = at(locate(src + i, src_virtual));
+
+    std::memcpy(expected.data(), memory + FRAMES, WINDOW_SIZE);
+    for (uint32_t i = 0; i < size; ++i) {
+        unsigned long real = locate(dest + i, dest_virtual);
+
+        if (real >= FRAMES && real < FRAMES + WINDOW_SIZE)
+            expected[real - FRAMES] = buffer[i];
+    }
+
+    dma::transfer(src, src_virtual, dest, dest_virtual, size);
+    return std::memcmp(expected.data(), memory + FRAMES, WINDOW_SIZE) == 0;
+}
+
+static void testTransfer() {
+    static const int IN_ORDER[WINDOW_PAGES] = {0, 1, 2, 3, 4, 5, 6, 7};
+    static const int SWAPPED[WINDOW_PAGES] = {1, 0, 3, 2, 5, 4, 7, 6};
+
+    // Real ranges overlapping in both directions, across pages
+    mapWindow(IN_ORDER);
+    pattern(FRAMES, WINDOW_SIZE, 1);
+    check(transferMatches(FRAMES + 0x123, false, FRAMES + 0x45, false, 0x3456), "transfer down");
+    check(transferMatches(FRAMES + 0x45, false, FRAMES + 0x846, false, 0x3456), "transfer up");
+    check(transferMatches(FRAMES + 0xff0, false, FRAMES + 0x1001, false, 0x20), "transfer up across a page");
+
+    // The destination's first byte follows the source's, but its later pages
+    // come before the source's
+    mapWindow(SWAPPED);
+    pattern(FRAMES, WINDOW_SIZE, 2);
+    check(transferMatches(WINDOW + 0x800, true, WINDOW + 0x1900, true, 0x2000), "transfer through swapped pages");
+    check(transferMatches(WINDOW + 0x1900, true, WINDOW + 0x800, true, 0x2000), "transfer back through swapped pages");
+    check(transferMatches(WINDOW + 0x10, true, FRAMES + 0x20, false, 0x3000), "transfer from swapped pages");
+
+    // Random ranges in the window, either end CPU or real
+    std::mt19937 random(816);
+    int order[WINDOW_PAGES];
+    int failed = 0;
+
+    for (int i = 0; i < WINDOW_PAGES; ++i)
+        order[i] = i;
+
+    for (int i = 0; i < 500; ++i) {
+        std::shuffle(order, order + WINDOW_PAGES, random);
+        mapWindow(order);
+        pattern(FRAMES, WINDOW_SIZE, i);
+
+        uint32_t size = random() % WINDOW_SIZE + 1;
+        uint32_t src = random() % (WINDOW_SIZE - size + 1);
+        uint32_t dest = random() % (WINDOW_SIZE - size + 1);
+        bool src_virtual = random() & 1;
+        bool dest_virtual = random() & 1;
+
+        if (!transferMatches((src_virtual ? WINDOW : FRAMES) + src, src_virtual,
+                             (dest_virtual ? WINDOW : FRAMES) + dest, dest_virtual, size))
+            ++failed;
+    }
+    check(failed == 0, "transfer between random ranges");
+    mem816::resetBanks();
+}
+
+// Blit between real addresses in the window and compare with a copy of the
+// whole source rectangle taken first
+static bool blitMatches(uint32_t src, uint16_t src_pitch, uint32_t dest, uint16_t dest_pitch,
+                        uint16_t width, uint16_t height, uint8_t size, bool keyed, uint32_t key) {
+    std::vector<uint8_t> expected(memory + FRAMES, memory + FRAMES + WINDOW_SIZE);
+    std::vector<uint8_t> rows;
+    uint32_t length = width * size;
+
+    for (uint16_t y = 0; y < height; ++y)
+        rows.insert(rows.end(), memory + src + y * src_pitch, memory + src + y * src_pitch + length);
+
+    for (uint16_t y = 0; y < height; ++y)
+        for (uint32_t x = 0; x < length; x += size) {
+            const uint8_t *pixel = &rows[y * length + x];
+            uint32_t value = 0;
+
+            std::memcpy(&value, pixel, size);
+            if (!keyed || value != key)
+                std::memcpy(&expected[dest - FRAMES + y * dest_pitch + x], pixel, size);
+        }
+
+    dma::blit(src, false, src_pitch, dest, false, dest_pitch, width, height, size, keyed, key);
+    return std::memcmp(expected.data(), memory + FRAMES, WINDOW_SIZE) == 0;
+}
+
+static void testBlit() {
+    // Small pattern values, so keys match often
+    for (uint32_t i = 0; i < WINDOW_SIZE; ++i)
+        memory[FRAMES + i] = (uint8_t) (i % 7 == 0 ? 0 : i % 5);
+
+    check(blitMatches(FRAMES + 0x10, 100, FRAMES + 0x4003, 90, 20, 30, 2, false, 0), "blit");
+    check(blitMatches(FRAMES + 0x10, 100, FRAMES + 0x4003, 90, 20, 30, 1, true, 0), "blit keyed bytes");
+    check(blitMatches(FRAMES + 0x11, 120, FRAMES + 0x5001, 128, 10, 30, 2, true, 0x0201), "blit keyed words");
+    check(blitMatches(FRAMES + 0x12, 120, FRAMES + 0x6000, 128, 7, 30, 3, true, 0x000403), "blit keyed triples");
+    check(blitMatches(FRAMES + 0x13, 120, FRAMES + 0x7000, 128, 5, 30, 4, true, 0x04030201), "blit keyed longs");
+
+    // Scrolling a rectangle down, up and sideways over itself
+    check(blitMatches(FRAMES + 0x100, 256, FRAMES + 0x100 + 3 * 256, 256, 100, 40, 2, false, 0), "blit down");
+    check(blitMatches(FRAMES + 0x100 + 3 * 256, 256, FRAMES + 0x100, 256, 100, 40, 2, false, 0), "blit up");
+    check(blitMatches(FRAMES + 0x100, 256, FRAMES + 0x104, 256, 100, 40, 2, false, 0), "blit right");
+    check(blitMatches(FRAMES + 0x100, 256, FRAMES + 0x100 + 2 * 256, 256, 100, 40, 1, true, 0), "blit keyed down");
+    check(blitMatches(FRAMES + 0x100, 256, FRAMES + 0x102, 256, 100, 40, 2, true, 0x0403), "blit keyed right");
+}
+
+// Copy out of RAM, host memory mapped apart from it and unmapped memory
+static void testCopyOut() {
+    static uint8_t apart[mem816::PAGE_SIZE];
+    std::vector<uint8_t> copy(0x3000);
+    int failed = 0;
+
+    pattern(HOLE - 0x2000, 0x2800, 3);
+    for (uint32_t i = 0; i < mem816::PAGE_SIZE; ++i)
+        apart[i] = (uint8_t) (i * 11 + 5);
+    mem816::mapHost(HOLE - 0x1000, mem816::PAGE_SIZE, apart, true);
+
+    dma::copyOut(HOLE - 0x2100, false, copy.data(), 0x2900);
+    for (uint32_t i = 0; i < 0x2900; ++i) {
+        uint32_t real = HOLE - 0x2100 + i;
+        uint8_t expected = real >= HOLE - 0x1000 && real < HOLE ? apart[real - (HOLE - 0x1000)] : at(real);
+
+        if (copy[i] != expected)
+            ++failed;
+    }
+    check(failed == 0, "copy out across host memory and unmapped memory");
+    mem816::mapHost(HOLE - 0x1000, mem816::PAGE_SIZE, memory + HOLE - 0x1000, true);
+}
+
+// Fill and check that every byte continues the pattern from the line's start
+static bool fillMatches(uint32_t dest, bool dest_virtual, uint32_t count, uint16_t lines, uint16_t pitch,
+                        uint8_t size, uint32_t value) {
+    dma::fill(dest, dest_virtual, count, lines, pitch, size, value);
+
+    for (uint16_t y = 0; y < lines; ++y)
+        for (uint32_t i = 0; i < count * size; ++i)
+            if (at(locate(dest + y * pitch + i, dest_virtual)) != (uint8_t) (value >> (8 * (i % size))))
+                return false;
+    return true;
+}
+
+static void testFill() {
+    static const int SWAPPED[WINDOW_PAGES] = {5, 2, 7, 0, 1, 6, 3, 4};
+
+    std::memset(memory + 0x100000, 0, 0x1000);
+    check(fillMatches(0x100001, false, 5, 3, 13, 2, 0xbbaa), "fill a rectangle");
+    check(memory[0x100000] == 0 && memory[0x10000b] == 0, "fill stays in the rectangle");
+    check(fillMatches(0x100ff1, false, 5000, 1, 0, 2, 0xbeef), "fill across pages");
+
+    // Into the unmapped bank, a byte at a time from an odd phase
+    check(fillMatches(HOLE - 13, false, 11, 1, 0, 4, 0x44332211), "fill into unmapped memory");
+    check(fillMatches(HOLE + HOLE_SIZE - 7, false, 9, 1, 0, 4, 0x88776655), "fill out of unmapped memory");
+
+    // Runs ending part way through a pattern
+    mapWindow(SWAPPED);
+    check(fillMatches(WINDOW + 0xffd, true, 3000, 1, 0, 4, 0xddccbbaa), "fill through swapped pages");
+    check(fillMatches(WINDOW + 0x1fff, true, 4097, 2, 0x2100, 2, 0x1234), "fill lines through swapped pages");
+    mem816::resetBanks();
+
+    // Lines too long to count in 32 bits are refused
+    memory[0x100000] = 0;
+    check(dma::fill(0x100000, false, 0x40000001, 1, 0, 4, 0x11111111) == 0 && memory[0x100000] == 0,
+          "fill refuses lines over 32 bits");
+}
+
+// Return the expected BGR888 of an RGB565 pixel, the top bits of each
+// component repeated in the bits below
+static void expand565(uint16_t pixel, uint8_t *bgr) {
+    uint8_t r = pixel >> 11, g = pixel >> 5 & 0x3f, b = pixel & 0x1f;
+
+    bgr[0] = b << 3 | b >> 2;
+    bgr[1] = g << 2 | g >> 4;
+    bgr[2] = r << 3 | r >> 2;
+}
+
+static void testConvert() {
+    static const uint32_t SRC = 0x400000;
+    static const uint32_t DEST = 0x500000;
+    static const uint32_t BACK = 0x600000;
+    static const uint32_t PALETTE = 0x700000;
+    int failed = 0;
+
+    // Every RGB565 pixel to BGR888, as 256 lines of 256
+    for (uint32_t i = 0; i < 0x10000; ++i) {
+        memory[SRC + 2 * i] = i & 0xff;
+        memory[SRC + 2 * i + 1] = i >> 8;
+    }
+    dma::convert(SRC, false, 512, DEST, false, 768, 256, 256, PIXEL_RGB565, PIXEL_BGR888, 0);
+
+    for (uint32_t i = 0; i < 0x10000; ++i) {
+        uint8_t bgr[3];
+
+        expand565(i, bgr);
+        if (std::memcmp(memory + DEST + 3 * i, bgr, 3) != 0)
+            ++failed;
+    }
+    check(failed == 0, "convert RGB565 to BGR888");
+
+    // And back again, unchanged
+    dma::convert(DEST, false, 768, BACK, false, 512, 256, 256, PIXEL_BGR888, PIXEL_RGB565, 0);
+    check(std::memcmp(memory + SRC, memory + BACK, 0x20000) == 0, "convert BGR888 to RGB565");
+
+    // Swapping red and blue
+    dma::convert(DEST, false, 768, BACK, false, 768, 256, 1, PIXEL_BGR888, PIXEL_RGB888, 0);
+    failed = 0;
+    for (uint32_t i = 0; i < 256; ++i)
+        if (memory[BACK + 3 * i] != memory[DEST + 3 * i + 2] || memory[BACK + 3 * i + 1] != memory[DEST + 3 * i + 1]
+            || memory[BACK + 3 * i + 2] != memory[DEST + 3 * i])
+            ++failed;
+    check(failed == 0, "convert BGR888 to RGB888");
+
+    // Palette indices, with a palette of RGB565 pixels expanded
+    for (uint32_t i = 0; i < 256; ++i) {
+        memory[SRC + i] = 255 - i;
+        expand565(i * 0x101, memory + PALETTE + 3 * i);
+    }
+    dma::convert(SRC, false, 256, BACK, false, 512, 256, 1, PIXEL_PAL8, PIXEL_RGB565, PALETTE);
+    failed = 0;
+    for (uint32_t i = 0; i < 256; ++i)
+        if ((uint32_t) (memory[BACK + 2 * i] | memory[BACK + 2 * i + 1] << 8) != (255 - i) * 0x101)
+            ++failed;
+    check(failed == 0, "convert PAL8 to RGB565");
+
+    // A pixel at a time where a row runs into unmapped memory
+    dma::convert(SRC, false, 512, HOLE - 11, false, 0, 20, 1, PIXEL_RGB565, PIXEL_BGR888, 0);
+    failed = 0;
+    for (uint32_t i = 0; i < 20; ++i) {
+        uint8_t bgr[3];
+
+        expand565(memory[SRC + 2 * i] | memory[SRC + 2 * i + 1] << 8, bgr);
+        for (int j = 0; j < 3; ++j)
+            if (at(HOLE - 11 + 3 * i + j) != bgr[j])
+                ++failed;
+    }
+    check(failed == 0, "convert into unmapped memory");
+}
+
+// Run a program at $1000 in emulation mode until it stops
+static void runProgram(const std::vector<uint8_t> &program) {
+    static const uint8_t VECTORS[] = {0x00, 0x10, 0x00, 0x0f};
+    static const uint8_t HANDLER[] = {
+        0xee, 0x00, 0x02,               // inc $0200
+        0x40                            // rti
+    };
+
+    std::memcpy(memory + 0xfffc, VECTORS, sizeof(VECTORS));
+    std::memcpy(memory + 0x0f00, HANDLER, sizeof(HANDLER));
+    std::memcpy(memory + 0x1000, program.data(), program.size());
+    memory[0x200] = 0;
+
+    emu816::reset(false);
+    emu816::run(~0UL, 100000000UL);
+}
+
+// A megabyte copied asynchronously: the status register shows it in flight,
+// a read of the destination straight after waits for it, and completion
+// raises an IRQ.
+static void testAsync() {
+    for (uint32_t i = 0; i < 0x100000; ++i)
+        memory[0x100000 + i] = (uint8_t) (i * 13 + (i >> 12));
+    std::memset(memory + 0x300000, 0, 0x100000);
+
+    runProgram({
+        0x58,                           // cli
+        0x02, 6, 0xc3,                  // cop #6, real transfer, DMA_ASYNC | DMA_IRQ
+        0x00, 0x00, 0x10, 0x00,         // from $100000
+        0x00, 0x00, 0x30, 0x00,         // to $300000
+        0x00, 0x00, 0x10, 0x00,         // $100000 bytes
+        0xaf, 0x00, 0xf0, 0x0f,         // lda $0ff000
+        0x8d, 0x10, 0x03,               // sta $0310
+        0xaf, 0x05, 0x10, 0x3f,         // lda $3f1005
+        0x8d, 0x00, 0x03,               // sta $0300
+        0xad, 0x00, 0x02,               // lda $0200
+        0xf0, 0xfb,                     // beq *-3
+        0xaf, 0x00, 0xf0, 0x0f,         // lda $0ff000
+        0x8d, 0x11, 0x03,               // sta $0311
+        0xdb                            // stp
+    });
+
+    check(emu816::getStopReason() == STOP, "asynchronous transfer stops");
+    check(memory[0x310] == 1, "asynchronous transfer busy at first");
+    check(memory[0x300] == memory[0x1f1005], "asynchronous transfer fenced");
+    check(memory[0x200] == 1, "asynchronous transfer raises an IRQ");
+    check(memory[0x311] == 0, "asynchronous transfer done");
+    check(std::memcmp(memory + 0x100000, memory + 0x300000, 0x100000) == 0, "asynchronous transfer copies");
+}
+
+// Start an asynchronous transfer with IRQs masked, then wait for it to
+// complete without reading the status register
+static std::vector<uint8_t> maskedTransfer() {
+    return {
+        0x78,                           // sei
+        0x02, 6, 0xc3,                  // cop #6, real transfer, DMA_ASYNC | DMA_IRQ
+        0x00, 0x00, 0x10, 0x00,         // from $100000
+        0x00, 0x00, 0x30, 0x00,         // to $300000
+        0x00, 0x40, 0x00, 0x00,         // $4000 bytes
+        0xa0, 0x10,                     // ldy #$10
+        0xa2, 0x00,                     // ldx #0
+        0xca,                           // dex
+        0xd0, 0xfd,                     // bne *-1
+        0x88,                           // dey
+        0xd0, 0xf8                      // bne *-6
+    };
+}
+
+// The completion IRQ is held while IRQs are masked, until it is taken or the
+// status register is read
+static void testMaskedIrq() {
+    std::vector<uint8_t> held = maskedTransfer();
+
+    held.insert(held.end(), {
+        0x58,                           // cli
+        0xea,                           // nop
+        0xad, 0x00, 0x02,               // lda $0200
+        0x8d, 0x12, 0x03,               // sta $0312
+        0xdb                            // stp
+    });
+    runProgram(held);
+    check(memory[0x312] == 1, "masked IRQ taken once unmasked");
+
+    std::vector<uint8_t> acknowledged = maskedTransfer();
+
+    acknowledged.insert(acknowledged.end(), {
+        0xaf, 0x00, 0xf0, 0x0f,         // lda $0ff000
+        0x58,                           // cli
+        0xea,                           // nop
+        0xad, 0x00, 0x02,               // lda $0200
+        0x8d, 0x13, 0x03,               // sta $0313
+        0xdb                            // stp
+    });
+    runProgram(acknowledged);
+    check(memory[0x313] == 0, "masked IRQ acknowledged by the status register");
+}
+
+int main() {
+    memory = new uint8_t[MEMORY_SIZE]();
+
+    if (emu816::loadMap(MAP, memory, MEMORY_SIZE) < 0) {
+        std::printf("FAILED: memory map\n");
+        return 1;
+    }
+
+    testTransfer();
+    testCopyOut();
+    testBlit();
+    testFill();
+    testConvert();
+    testAsync();
+    testMaskedIrq();
+
+    dma::settle();
+    std::printf("%s: %d failed\n", failures ? "FAILED" : "PASSED", failures);
+    return failures;
+}
@@ -0,0 +1,391 @@
+// Checks of the tile and sprite device's output against the rules in ppu.hpp.
+//
+// Each check draws a small frame from tables in host RAM and compares pixels
+// with the tile index expected there. The palette maps index i to colour
+// $1000 + i, so each output pixel names the index it shows; the backdrop is a
+// colour no index maps to.
+//
+// Exits with the number of failed checks.
+
+#include "emu816.h"
+#include "ppu.hpp"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+static const uint32_t MEMORY_SIZE = 1 << 24;
+static const uint32_t PALETTE = 0x10000;
+static const uint32_t MAPS[ppu::LAYERS] = {0x20000, 0x30000};
+static const uint32_t SPRITES = 0x40000;
+static const uint32_t TARGET = 0x50000;
+static const uint32_t TILES[ppu::LAYERS] = {0x100000, 0x140000};
+static const uint32_t SPRITE_TILES = 0x180000;
+
+static const int WIDTH = 32;                    // Output, in pixels
+static const int HEIGHT = 16;
+static const int PITCH = 2 * WIDTH;
+static const int MAP_LOG = 2;                   // Maps of 4x4 tiles
+static const uint16_t BACKDROP = 0xbeef;
+static const int NONE = -1;                     // The backdrop's index
+
+// Map entry and sprite flags
+static const uint16_t FLIP_X = 0x1000;
+static const uint16_t FLIP_Y = 0x2000;
+static const uint16_t HIGH = 0x4000;
+static const uint8_t SPRITE_FLIP_X = 0x01;
+static const uint8_t SPRITE_FLIP_Y = 0x02;
+static const uint8_t SPRITE_HIGH = 0x04;
+static const uint8_t SPRITE_HIDDEN = 0x80;
+
+static const char *MAP =
+    "MEMORY {\n"
+    "    RAM: start = $0, size = $1000000;\n"
+    "}\n";
+
+static uint8_t *memory;
+static int failures;
+
+extern "C" {
+    uint8_t readb(uint32_t) {
+        return 0;
+    }
+
+    void writeb(uint32_t, uint8_t) {
+    }
+}
+
+static void check(bool passed, const char *what) {
+    if (!passed) {
+        std::printf("FAILED: %s\n", what);
+        ++failures;
+    }
+}
+
+static void reg8(int offset, uint8_t value) {
+    ppu::write(NULL, offset, value);
+}
+
+static void reg16(int offset, uint16_t value) {
+    reg8(offset, value & 0xff);
+    reg8(offset + 1, value >> 8);
+}
+
+static void reg32(int offset, uint32_t value) {
+    reg16(offset, value & 0xffff);
+    reg16(offset + 2, value >> 16);
+}
+
+static int layerReg(int layer, int offset) {
+    return ppu::PPU_LAYERS + layer * ppu::PPU_LAYER_SIZE + offset;
+}
+
+static void put16(uint32_t addr, uint16_t value) {
+    memory[addr] = value & 0xff;
+    memory[addr + 1] = value >> 8;
+}
+
+// Clear the tables and point the device at them, with the given layers and
+// sprites enabled
+static void setup(uint8_t control, int sprite_count) {
+    std::memset(memory, 0, MEMORY_SIZE);
+    for (int i = 0; i < 256; ++i)
+        put16(PALETTE + 2 * i, 0x1000 + i);
+
+    ppu::reset();
+    reg8(ppu::PPU_CONTROL, ppu::PPU_ENABLE | control);
+    reg8(ppu::PPU_SPRITE_COUNT, sprite_count);
+    reg16(ppu::PPU_BACKDROP, BACKDROP);
+    reg32(ppu::PPU_TARGET, TARGET);
+    reg16(ppu::PPU_TARGET_PITCH, PITCH);
+    reg16(ppu::PPU_WIDTH, WIDTH);
+    reg16(ppu::PPU_HEIGHT, HEIGHT);
+    reg32(ppu::PPU_PALETTE, PALETTE);
+    reg32(ppu::PPU_SPRITES, SPRITES);
+    reg32(ppu::PPU_SPRITE_TILES, SPRITE_TILES);
+
+    for (int i = 0; i < ppu::LAYERS; ++i) {
+        reg32(layerReg(i, ppu::PPU_LAYER_MAP), MAPS[i]);
+        reg32(layerReg(i, ppu::PPU_LAYER_TILES), TILES[i]);
+        reg8(layerReg(i, ppu::PPU_LAYER_MAP_WIDTH), MAP_LOG);
+        reg8(layerReg(i, ppu::PPU_LAYER_MAP_HEIGHT), MAP_LOG);
+    }
+}
+
+// Return the address of a pixel of a tile
+static uint32_t tilePixel(uint32_t table, int tile, int x, int y) {
+    return table + tile * ppu::TILE_SIZE * ppu::TILE_SIZE + y * ppu::TILE_SIZE + x;
+}
+
+// Fill a tile with one index
+static void solidTile(uint32_t table, int tile, uint8_t index) {
+    std::memset(memory + tilePixel(table, tile, 0, 0), index, ppu::TILE_SIZE * ppu::TILE_SIZE);
+}
+
+// Fill a tile with indices that differ at every pixel, starting at first
+static void patternTile(uint32_t table, int tile, int first) {
+    for (int y = 0; y < ppu::TILE_SIZE; ++y)
+        for (int x = 0; x < ppu::TILE_SIZE; ++x)
+            memory[tilePixel(table, tile, x, y)] = first + y * ppu::TILE_SIZE + x;
+}
+
+// Set every entry of a layer's map
+static void fillMap(int layer, uint16_t entry) {
+    for (int i = 0; i < 1 << (2 * MAP_LOG); ++i)
+        put16(MAPS[layer] + 2 * i, entry);
+}
+
+static void sprite(int number, int16_t x, int16_t y, uint16_t first, uint8_t flags, int columns, int rows) {
+    uint32_t entry = SPRITES + number * 8;
+
+    put16(entry, x);
+    put16(entry + 2, y);
+    put16(entry + 4, first);
+    memory[entry + 6] = flags;
+    memory[entry + 7] = (columns - 1) | (rows - 1) << 3;
+}
+
+// Return the index shown at a pixel of the output, or NONE for the backdrop
+static int shown(int x, int y) {
+    uint32_t addr = TARGET + y * PITCH + 2 * x;
+    uint16_t color = memory[addr] | memory[addr + 1] << 8;
+
+    return color == BACKDROP ? NONE : color - 0x1000;
+}
+
+// True if no pixel of the output shows anything but the backdrop outside the
+// rectangle given
+static bool clearOutside(int left, int top, int right, int bottom) {
+    for (int y = 0; y < HEIGHT; ++y)
+        for (int x = 0; x < WIDTH; ++x)
+            if ((x < left || x >= right || y < top || y >= bottom) && shown(x, y) != NONE)
+                return false;
+    return true;
+}
+
+// Draw both layers and a sprite over the whole output, with the priorities
+// given, and return the index shown
+static int rankedPixel(bool layer1, uint16_t high1, bool layer0, uint16_t high0, bool sprite_on, uint8_t high) {
+    setup(ppu::PPU_LAYER0 | ppu::PPU_LAYER1 | ppu::PPU_SPRITES_ON, 1);
+    solidTile(TILES[0], 1, 10);
+    solidTile(TILES[1], 1, 20);
+    solidTile(SPRITE_TILES, 1, 30);
+    fillMap(0, layer0 ? 1 | high0 : 0);
+    fillMap(1, layer1 ? 1 | high1 : 0);
+    sprite(0, 0, 0, 1, sprite_on ? high : SPRITE_HIDDEN, 8, 8);
+
+    ppu::render();
+    return shown(3, 3);
+}
+
+static void testRanks() {
+    check(rankedPixel(false, 0, false, 0, false, 0) == NONE, "backdrop behind everything");
+    check(rankedPixel(true, 0, false, 0, false, 0) == 20, "layer 1 over the backdrop");
+    check(rankedPixel(true, 0, true, 0, false, 0) == 10, "layer 0 over layer 1");
+    check(rankedPixel(true, 0, true, 0, true, 0) == 30, "sprite over layer 0");
+    check(rankedPixel(true, HIGH, true, 0, true, 0) == 20, "layer 1 with priority over sprite");
+    check(rankedPixel(true, HIGH, true, HIGH, true, 0) == 10, "layer 0 with priority over layer 1 with priority");
+    check(rankedPixel(false, 0, true, HIGH, true, 0) == 10, "layer 0 with priority over sprite");
+    check(rankedPixel(true, HIGH, true, HIGH, true, SPRITE_HIGH) == 30, "sprite with priority over everything");
+    check(rankedPixel(false, 0, false, 0, true, SPRITE_HIGH) == 30, "sprite with priority alone");
+
+    // Transparent pixels of a front layer show what is behind
+    setup(ppu::PPU_LAYER0 | ppu::PPU_LAYER1, 0);
+    solidTile(TILES[1], 1, 20);
+    patternTile(TILES[0], 1, 0);
+    fillMap(0, 1 | HIGH);
+    fillMap(1, 1);
+    ppu::render();
+    check(shown(0, 0) == 20 && shown(1, 0) == 1, "layer 0 transparent at index 0");
+
+    // Lower numbered sprites are in front
+    setup(ppu::PPU_SPRITES_ON, 2);
+    solidTile(SPRITE_TILES, 1, 30);
+    solidTile(SPRITE_TILES, 2, 31);
+    sprite(0, 4, 0, 1, 0, 1, 1);
+    sprite(1, 0, 0, 2, 0, 1, 1);
+    ppu::render();
+    check(shown(2, 2) == 31 && shown(6, 2) == 30 && shown(10, 2) == 30, "sprite 0 in front of sprite 1");
+}
+
+// True if the first tile of the output shows tile 1 of layer 0 with the flips
+// given
+static bool mapFlipMatches(uint16_t flips) {
+    setup(ppu::PPU_LAYER0, 0);
+    patternTile(TILES[0], 1, 1);
+    fillMap(0, 1 | flips);
+    ppu::render();
+
+    for (int y = 0; y < ppu::TILE_SIZE; ++y)
+        for (int x = 0; x < ppu::TILE_SIZE; ++x) {
+            int tx = (flips & FLIP_X) ? ppu::TILE_SIZE - 1 - x : x;
+            int ty = (flips & FLIP_Y) ? ppu::TILE_SIZE - 1 - y : y;
+
+            if (shown(x, y) != memory[tilePixel(TILES[0], 1, tx, ty)])
+                return false;
+        }
+    return true;
+}
+
+// True if a sprite of 2x2 tiles at the origin shows its tiles with the flips
+// given; the flips apply to the whole sprite, not to each tile
+static bool spriteFlipMatches(uint8_t flips) {
+    static const int SIDE = 2 * ppu::TILE_SIZE;
+
+    setup(ppu::PPU_SPRITES_ON, 1);
+    for (int tile = 0; tile < 4; ++tile)
+        patternTile(SPRITE_TILES, 4 + tile, 1 + tile * 48);
+    sprite(0, 0, 0, 4, flips, 2, 2);
+    ppu::render();
+
+    for (int y = 0; y < SIDE; ++y)
+        for (int x = 0; x < SIDE; ++x) {
+            int sx = (flips & SPRITE_FLIP_X) ? SIDE - 1 - x : x;
+            int sy = (flips & SPRITE_FLIP_Y) ? SIDE - 1 - y : y;
+            int tile = 4 + (sy / ppu::TILE_SIZE) * 2 + sx / ppu::TILE_SIZE;
+            int expected = memory[tilePixel(SPRITE_TILES, tile, sx % ppu::TILE_SIZE, sy % ppu::TILE_SIZE)];
+
+            if (shown(x, y) != expected)
+                return false;
+        }
+    return clearOutside(0, 0, SIDE, SIDE);
+}
+
+static void testFlips() {
+    check(mapFlipMatches(0), "map tile unflipped");
+    check(mapFlipMatches(FLIP_X), "map tile flipped horizontally");
+    check(mapFlipMatches(FLIP_Y), "map tile flipped vertically");
+    check(mapFlipMatches(FLIP_X | FLIP_Y), "map tile flipped both ways");
+
+    check(spriteFlipMatches(0), "sprite unflipped");
+    check(spriteFlipMatches(SPRITE_FLIP_X), "sprite flipped horizontally");
+    check(spriteFlipMatches(SPRITE_FLIP_Y), "sprite flipped vertically");
+    check(spriteFlipMatches(SPRITE_FLIP_X | SPRITE_FLIP_Y), "sprite flipped both ways");
+}
+
+// True if layer 0, each of whose tiles is solid in its own index, shows the
+// right tile at every pixel when scrolled by the amounts given
+static bool scrollMatches(uint16_t scroll_x, uint16_t scroll_y) {
+    static const int SIDE = 1 << MAP_LOG;
+
+    setup(ppu::PPU_LAYER0, 0);
+    for (int i = 0; i < SIDE * SIDE; ++i) {
+        solidTile(TILES[0], 1 + i, 1 + i);
+        put16(MAPS[0] + 2 * i, 1 + i);
+    }
+    reg16(layerReg(0, ppu::PPU_LAYER_SCROLL_X), scroll_x);
+    reg16(layerReg(0, ppu::PPU_LAYER_SCROLL_Y), scroll_y);
+    ppu::render();
+
+    for (int y = 0; y < HEIGHT; ++y)
+        for (int x = 0; x < WIDTH; ++x) {
+            int column = (x + scroll_x) / ppu::TILE_SIZE % SIDE;
+            int row = (y + scroll_y) / ppu::TILE_SIZE % SIDE;
+
+            if (shown(x, y) != 1 + row * SIDE + column)
+                return false;
+        }
+    return true;
+}
+
+static void testScroll() {
+    check(scrollMatches(0, 0), "layer unscrolled");
+    check(scrollMatches(3, 5), "layer scrolled within a tile");
+    check(scrollMatches(20, 28), "layer scrolled across the map's edge");
+    check(scrollMatches(0xfffb, 0xfff9), "layer scrolled to the end of the register");
+
+    // A map wider than it is tall wraps on each axis by its own size
+    setup(ppu::PPU_LAYER0, 0);
+    reg8(layerReg(0, ppu::PPU_LAYER_MAP_WIDTH), 1);
+    reg8(layerReg(0, ppu::PPU_LAYER_MAP_HEIGHT), 0);
+    solidTile(TILES[0], 1, 1);
+    solidTile(TILES[0], 2, 2);
+    put16(MAPS[0], 1);
+    put16(MAPS[0] + 2, 2);
+    reg16(layerReg(0, ppu::PPU_LAYER_SCROLL_Y), 3);
+    ppu::render();
+    check(shown(0, 0) == 1 && shown(8, 15) == 2 && shown(16, 7) == 1 && shown(31, 0) == 2,
+          "2x1 tile map wraps each way");
+}
+
+static void testSpriteClipping() {
+    setup(ppu::PPU_SPRITES_ON, 1);
+    patternTile(SPRITE_TILES, 1, 1);
+
+    // Off the top left corner: only the bottom right of the tile shows
+    sprite(0, -5, -3, 1, 0, 1, 1);
+    ppu::render();
+    check(shown(0, 0) == memory[tilePixel(SPRITE_TILES, 1, 5, 3)]
+          && shown(2, 4) == memory[tilePixel(SPRITE_TILES, 1, 7, 7)]
+          && clearOutside(0, 0, 3, 5), "sprite clipped at negative x and y");
+
+    // Off the bottom right corner
+    sprite(0, WIDTH - 2, HEIGHT - 1, 1, 0, 1, 1);
+    ppu::render();
+    check(shown(WIDTH - 2, HEIGHT - 1) == memory[tilePixel(SPRITE_TILES, 1, 0, 0)]
+          && shown(WIDTH - 1, HEIGHT - 1) == memory[tilePixel(SPRITE_TILES, 1, 1, 0)]
+          && clearOutside(WIDTH - 2, HEIGHT - 1, WIDTH, HEIGHT), "sprite clipped at the right and bottom");
+
+    // Flipped sprites clip the flipped image
+    sprite(0, -6, 0, 1, SPRITE_FLIP_X, 1, 1);
+    ppu::render();
+    check(shown(0, 0) == memory[tilePixel(SPRITE_TILES, 1, 1, 0)]
+          && shown(1, 0) == memory[tilePixel(SPRITE_TILES, 1, 0, 0)]
+          && clearOutside(0, 0, 2, 8), "flipped sprite clipped at negative x");
+
+    // Wholly outside, including the most negative positions
+    static const int16_t AWAY[][2] = {
+        {-8, 0}, {0, -8}, {WIDTH, 0}, {0, HEIGHT}, {-32768, -32768}, {32767, 32767}
+    };
+
+    bool clear = true;
+
+    for (const int16_t *position : AWAY) {
+        sprite(0, position[0], position[1], 1, 0, 1, 1);
+        ppu::render();
+        clear = clear && clearOutside(0, 0, 0, 0);
+    }
+    check(clear, "sprites off the output draw nothing");
+}
+
+static unsigned frameCounter() {
+    return ppu::read(NULL, ppu::PPU_FRAME) | ppu::read(NULL, ppu::PPU_FRAME + 1) << 8;
+}
+
+static void testFrameCounter() {
+    setup(0, 0);
+    check(frameCounter() == 0, "frame counter zero after reset");
+
+    ppu::render();
+    ppu::render();
+    check(frameCounter() == 2, "frame counter counts frames drawn");
+
+    reg16(ppu::PPU_FRAME, 0x1234);
+    check(frameCounter() == 2, "frame counter read-only");
+
+    reg8(ppu::PPU_CONTROL, 0);
+    check(!ppu::render() && frameCounter() == 2, "frame counter still while disabled");
+
+    reg8(ppu::PPU_CONTROL, ppu::PPU_ENABLE);
+    for (int i = 2; i < 0x10000; ++i)
+        ppu::render();
+    check(frameCounter() == 0, "frame counter wraps at 16 bits");
+}
+
+int main() {
+    memory = new uint8_t[MEMORY_SIZE]();
+
+    if (emu816::loadMap(MAP, memory, MEMORY_SIZE) < 0) {
+        std::printf("FAILED: memory map\n");
+        return 1;
+    }
+
+    testRanks();
+    testFlips();
+    testScroll();
+    testSpriteClipping();
+    testFrameCounter();
+
+    std::printf("%s: %d failed\n", failures ? "FAILED" : "PASSED", failures);
+    return failures;
+}